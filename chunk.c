@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -10,12 +11,15 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(Byte, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
 
@@ -36,5 +40,224 @@ int addConstant(Chunk* chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
+
+  if (chunk->cacheCapacity < chunk->constants.capacity) {
+    // Caches are only marked up to cacheCapacity, so update it after
+    // growing the array in case growing it triggers a collection.
+    int oldCapacity = chunk->cacheCapacity;
+    int capacity = chunk->constants.capacity;
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, capacity);
+    memset(chunk->caches + oldCapacity, 0, sizeof(InlineCache) * (capacity - oldCapacity));
+    chunk->cacheCapacity = capacity;
+  }
+
   return chunk->constants.count - 1;
 }
+
+// ----------------------------------------------------------------------
+
+// Bytes taken by the instruction at 'offset' and its operands. The
+// peephole pass and the disassembler both step through code with this.
+int instructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_EQUAL_JUMP_IF_FALSE:
+    case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_INVOKE:
+    case OP_INVOKE_SUPER:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LESS_EQUAL_JUMP_IF_FALSE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_NOT_EQUAL_JUMP_IF_FALSE:
+      return 3;
+    case OP_ITER_NEXT:
+      return 4;
+    case OP_CALL:
+    case OP_CALL_POSTFIX:
+    case OP_CLASS:
+    case OP_COLLECTION_LIST:
+    case OP_COLLECTION_TABLE:
+    case OP_CONSTANT:
+    case OP_GLOBAL_DEFINE:
+    case OP_GLOBAL_GET:
+    case OP_GLOBAL_SET:
+    case OP_INDEX_GET:
+    case OP_INDEX_SET:
+    case OP_LOCAL_GET:
+    case OP_LOCAL_SET:
+    case OP_METHOD:
+    case OP_PROPERTY_GET:
+    case OP_PROPERTY_SET:
+    case OP_SUPER_GET:
+    case OP_UPVALUE_GET:
+    case OP_UPVALUE_SET:
+      return 2;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+      return 2 + 2 * function->upvalueCount;
+    }
+    default:
+      return 1;
+  }
+}
+
+static bool isJump(Byte instruction) {
+  switch (instruction) {
+    case OP_EQUAL_JUMP_IF_FALSE:
+    case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_ITER_NEXT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LESS_EQUAL_JUMP_IF_FALSE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_NOT_EQUAL_JUMP_IF_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << BYTE_WIDTH) | chunk->code[offset + 2];
+  return (chunk->code[offset] == OP_LOOP) ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// Comparison produced by a comparison followed by OP_NOT, or -1.
+static int negatedComparison(Byte instruction) {
+  switch (instruction) {
+    case OP_EQUAL: return OP_NOT_EQUAL;
+    case OP_GREATER: return OP_LESS_EQUAL;
+    case OP_LESS: return OP_GREATER_EQUAL;
+    default: return -1;
+  }
+}
+
+// Comparison fused with a following OP_JUMP_IF_FALSE and OP_POP, or -1.
+static int comparisonJump(Byte instruction) {
+  switch (instruction) {
+    case OP_EQUAL: return OP_EQUAL_JUMP_IF_FALSE;
+    case OP_GREATER: return OP_GREATER_JUMP_IF_FALSE;
+    case OP_GREATER_EQUAL: return OP_GREATER_EQUAL_JUMP_IF_FALSE;
+    case OP_LESS: return OP_LESS_JUMP_IF_FALSE;
+    case OP_LESS_EQUAL: return OP_LESS_EQUAL_JUMP_IF_FALSE;
+    case OP_NOT_EQUAL: return OP_NOT_EQUAL_JUMP_IF_FALSE;
+    default: return -1;
+  }
+}
+
+// Is there an instruction starting at 'offset' that is not a jump target?
+static bool canFuse(Chunk* chunk, bool* isTarget, int offset, Byte instruction) {
+  return (offset < chunk->count) &&
+         (chunk->code[offset] == instruction) &&
+         !isTarget[offset];
+}
+
+// Peephole pass that fuses common instruction sequences into
+// superinstructions:
+//   OP_EQUAL/OP_GREATER/OP_LESS + OP_NOT => OP_NOT_EQUAL/OP_LESS_EQUAL/OP_GREATER_EQUAL
+//   comparison + OP_JUMP_IF_FALSE + OP_POP => comparison_JUMP_IF_FALSE
+//   OP_LOCAL_GET + OP_CONSTANT + OP_ADD => OP_ADD_LOCAL_CONSTANT
+// A fused comparison-and-jump pushes 'false' only when it jumps, since
+// the fall-through path would immediately pop the result. Sequences are
+// only fused if no jump lands inside them, and jumps are re-targeted
+// afterward.
+void optimizeChunk(Chunk* chunk) {
+  int count = chunk->count;
+  bool* isTarget = ALLOCATE(bool, count + 1);
+  int* newOffsets = ALLOCATE(int, count + 1);
+  memset(isTarget, 0, sizeof(bool) * (count + 1));
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    if (isJump(chunk->code[offset])) {
+      isTarget[jumpTarget(chunk, offset)] = true;
+    }
+  }
+
+  Byte* code = ALLOCATE(Byte, chunk->capacity);
+  int* lines = ALLOCATE(int, chunk->capacity);
+  int* oldJumps = ALLOCATE(int, count);
+  int* newJumps = ALLOCATE(int, count);
+  int numJumps = 0;
+  int out = 0;
+
+  for (int offset = 0; offset < count;) {
+    newOffsets[offset] = out;
+    Byte instruction = chunk->code[offset];
+    int line = chunk->lines[offset];
+    int length = instructionLength(chunk, offset);
+
+    if ((instruction == OP_LOCAL_GET) &&
+        canFuse(chunk, isTarget, offset + 2, OP_CONSTANT) &&
+        canFuse(chunk, isTarget, offset + 4, OP_ADD)) {
+      code[out] = OP_ADD_LOCAL_CONSTANT;
+      code[out + 1] = chunk->code[offset + 1];
+      code[out + 2] = chunk->code[offset + 3];
+      lines[out] = lines[out + 1] = lines[out + 2] = line;
+      out += 3;
+      offset += 5;
+      continue;
+    }
+
+    int fused = instruction;
+    if ((negatedComparison(instruction) != -1) &&
+        canFuse(chunk, isTarget, offset + 1, OP_NOT)) {
+      fused = negatedComparison(instruction);
+      length = 2;
+    }
+
+    if ((comparisonJump(fused) != -1) &&
+        canFuse(chunk, isTarget, offset + length, OP_JUMP_IF_FALSE) &&
+        canFuse(chunk, isTarget, offset + length + 3, OP_POP)) {
+      oldJumps[numJumps] = jumpTarget(chunk, offset + length);
+      newJumps[numJumps++] = out;
+      code[out] = comparisonJump(fused);
+      lines[out] = lines[out + 1] = lines[out + 2] = line;
+      out += 3;
+      offset += length + 4;
+      continue;
+    }
+
+    if (fused != instruction) {
+      code[out] = fused;
+      lines[out] = line;
+      out += 1;
+      offset += length;
+      continue;
+    }
+
+    if (isJump(instruction)) {
+      oldJumps[numJumps] = jumpTarget(chunk, offset);
+      newJumps[numJumps++] = out;
+    }
+    memcpy(code + out, chunk->code + offset, length);
+    for (int i = 0; i < length; i++) {
+      lines[out + i] = chunk->lines[offset + i];
+    }
+    out += length;
+    offset += length;
+  }
+  newOffsets[count] = out;
+
+  for (int i = 0; i < numJumps; i++) {
+    int at = newJumps[i];
+    int target = newOffsets[oldJumps[i]];
+    int jump = (code[at] == OP_LOOP) ? (at + 3 - target) : (target - at - 3);
+    code[at + 1] = (jump >> BYTE_WIDTH) & BYTE_MASK;
+    code[at + 2] = jump & BYTE_MASK;
+  }
+
+  FREE_ARRAY(Byte, chunk->code, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  chunk->code = code;
+  chunk->lines = lines;
+  chunk->count = out;
+
+  FREE_ARRAY(bool, isTarget, count + 1);
+  FREE_ARRAY(int, newOffsets, count + 1);
+  FREE_ARRAY(int, oldJumps, count);
+  FREE_ARRAY(int, newJumps, count);
+}
@@ -6,6 +6,7 @@
 
 typedef enum {
   OP_ADD,
+  OP_ADD_LOCAL_CONSTANT,
   OP_CALL,
   OP_CALL_POSTFIX,
   OP_CLASS,
@@ -15,17 +16,28 @@ typedef enum {
   OP_CONSTANT,
   OP_DIVIDE,
   OP_EQUAL,
+  OP_EQUAL_JUMP_IF_FALSE,
   OP_FALSE,
   OP_GLOBAL_DEFINE,
   OP_GLOBAL_GET,
   OP_GLOBAL_SET,
   OP_GREATER,
+  OP_GREATER_EQUAL,
+  OP_GREATER_EQUAL_JUMP_IF_FALSE,
+  OP_GREATER_JUMP_IF_FALSE,
+  OP_INDEX_GET,
+  OP_INDEX_SET,
   OP_INHERIT,
   OP_INVOKE,
   OP_INVOKE_SUPER,
+  OP_ITER_INIT,
+  OP_ITER_NEXT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LESS,
+  OP_LESS_EQUAL,
+  OP_LESS_EQUAL_JUMP_IF_FALSE,
+  OP_LESS_JUMP_IF_FALSE,
   OP_LOCAL_GET,
   OP_LOCAL_SET,
   OP_LOOP,
@@ -34,6 +46,8 @@ typedef enum {
   OP_NEGATE,
   OP_NIL,
   OP_NOT,
+  OP_NOT_EQUAL,
+  OP_NOT_EQUAL_JUMP_IF_FALSE,
   OP_POP,
   OP_PROPERTY_GET,
   OP_PROPERTY_SET,
@@ -46,17 +60,42 @@ typedef enum {
   OP_UPVALUE_SET
 } OpCode;
 
+// Inline cache entry for the instruction that uses the corresponding
+// constant. Global variable entries are valid while 'version' matches
+// the globals table's version (versions start at 1, so a zeroed entry
+// is empty). Method entries also require the receiver's class to be
+// 'key', and field entries hold the 'index' of the field's slot in
+// instances whose shape is 'key'.
+typedef struct {
+  Obj* key;
+  uint32_t version;
+  int index;
+  Value* slot;
+} CacheEntry;
+
+// Method and field caches remember up to CACHE_WAYS classes or shapes;
+// global variable caches only use the first entry.
+#define CACHE_WAYS 2
+
+typedef struct {
+  CacheEntry entries[CACHE_WAYS];
+} InlineCache;
+
 typedef struct {
   int count;
   int capacity;
   Byte* code;
   int* lines;
   ValueArray constants;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, Byte byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);
+void optimizeChunk(Chunk* chunk);
 
 #endif
@@ -9,6 +9,12 @@
 
 #define NAN_BOXING
 
+// Use labels-as-values threaded dispatch in the interpreter loop when the
+// compiler supports it; build with -DNO_COMPUTED_GOTO to use the switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 typedef uint8_t Byte;
 #define BYTE_WIDTH 8
 #define BYTE_MASK 0xFF
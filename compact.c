@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compact.h"
+#include "config.h"
+#include "constants.h"
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Heap compaction. After a full collection, the objects on the sparsest
+// pages of each size class are copied into free slots on the other pages,
+// leaving a forwarding pointer behind them, and every reference is then
+// updated before the emptied pages are released.
+//
+// Pointers held by C code are not updated, so the heap is only compacted
+// at safe points: by the gc() native, and on a backward jump in the
+// interpreter once a collection has found the heap fragmented. Pinned
+// objects, every fiber among them, never move.
+
+static bool hasPinned_ = false;
+static int moved_ = 0;
+
+static void findPinned(void* slot) {
+  if (((Obj*)slot)->isPinned) {
+    hasPinned_ = true;
+  }
+}
+
+static bool hasPinnedObject(SlabPage* page) {
+  hasPinned_ = false;
+  slabEachInPage(page, findPinned);
+  return hasPinned_;
+}
+
+static int compareLiveCount(const void* a, const void* b) {
+  return (*(SlabPage**)a)->liveCount - (*(SlabPage**)b)->liveCount;
+}
+
+// Flag the sparsest pages of a size class for evacuation, as many as the
+// free slots of the other pages have room for. Returns how many.
+static int selectPages(SlabClass* sizeClass) {
+  int count = 0;
+  for (SlabPage* page = sizeClass->pages; page != NULL; page = page->next) {
+    count++;
+  }
+  if (count < 2) {
+    return 0;
+  }
+
+  SlabPage** candidates = (SlabPage**)malloc(sizeof(SlabPage*) * count);
+  if (candidates == NULL) {
+    exit(1);
+  }
+  int perPage = slabSlotsPerPage(sizeClass->pages->slotSize);
+  int room = 0;
+  count = 0;
+  for (SlabPage* page = sizeClass->pages; page != NULL; page = page->next) {
+    room += perPage - page->liveCount;
+    if ((page->liveCount > 0) && !hasPinnedObject(page)) {
+      candidates[count++] = page;
+    }
+  }
+  qsort(candidates, count, sizeof(SlabPage*), compareLiveCount);
+
+  int moving = 0;
+  int selected = 0;
+  for (; selected < count; selected++) {
+    SlabPage* page = candidates[selected];
+    int roomLeft = room - (perPage - page->liveCount);
+    if (moving + page->liveCount > roomLeft) {
+      break;
+    }
+    room = roomLeft;
+    moving += page->liveCount;
+    page->isEvacuating = true;
+  }
+  free(candidates);
+  return selected;
+}
+
+// Copy an object to a free slot, and leave the copy's address in the
+// second word of the old slot. Every slot has room for it.
+static void moveObject(void* slot) {
+  size_t size = slabPageOf(slot)->slotSize;
+  Obj* copy = (Obj*)slabAllocate(&vm_.slabs, size);
+  memcpy(copy, slot, size);
+
+  // A closed upvalue points to its own value.
+  if (copy->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+    if (upvalue->location == &((ObjUpvalue*)slot)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+  ((Obj**)slot)[1] = copy;
+  moved_++;
+}
+
+static Obj* forward(Obj* object) {
+  if ((object != NULL) && slabPageOf(object)->isEvacuating) {
+    return ((Obj**)object)[1];
+  }
+  return object;
+}
+
+#define FORWARD(pointer) ((pointer) = (void*)forward((Obj*)(pointer)))
+
+void forwardValue(Value* value) {
+  if (IS_OBJ(*value)) {
+    *value = OBJ_VAL(forward(AS_OBJ(*value)));
+  }
+}
+
+static void forwardArray(ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    forwardValue(&array->values[i]);
+  }
+}
+
+static void forwardTable(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    FORWARD(entry->key);
+    forwardValue(&entry->value);
+  }
+}
+
+// A map whose keys include a moved object, other than a string, which
+// is hashed by its contents, must be indexed again.
+static void forwardMap(Map* map) {
+  bool moved = false;
+  for (int i = 0; i < map->used; i++) {
+    MapEntry* entry = &map->entries[i];
+    if (IS_OBJ(entry->key) && !IS_STRING(entry->key)) {
+      Obj* key = AS_OBJ(entry->key);
+      moved = moved || (forward(key) != key);
+    }
+    forwardValue(&entry->key);
+    forwardValue(&entry->value);
+  }
+  if (moved) {
+    rehashMap(map);
+  }
+}
+
+static void forwardCaches(Chunk* chunk) {
+  for (int i = 0; i < chunk->cacheCapacity; i++) {
+    for (int j = 0; j < CACHE_WAYS; j++) {
+      FORWARD(chunk->caches[i].entries[j].key);
+    }
+  }
+}
+
+// Fibers never move, so the fields that point to fibers stay as they are.
+static void forwardFiber(ObjFiber* fiber) {
+  for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+    forwardValue(slot);
+  }
+  for (int i = 0; i < fiber->frameCount; i++) {
+    FORWARD(fiber->frames[i].closure);
+  }
+  FORWARD(fiber->openUpvalues);
+}
+
+// Update the references held by an object that has not moved, or by the
+// copy of one that has.
+static void forwardFields(void* slot) {
+  if (slabPageOf(slot)->isEvacuating) {
+    return;
+  }
+
+  Obj* object = (Obj*)slot;
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      forwardValue(&bound->receiver);
+      FORWARD(bound->method);
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      FORWARD(klass->name);
+      forwardTable(&klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      FORWARD(closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        FORWARD(closure->upvalues[i]);
+      }
+      break;
+    }
+
+    case OBJ_FIBER: {
+      forwardFiber((ObjFiber*)object);
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      FORWARD(function->name);
+      forwardArray(&function->chunk.constants);
+      forwardCaches(&function->chunk);
+      break;
+    }
+
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      FORWARD(instance->klass);
+      FORWARD(instance->shape);
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->slotCount; i++) {
+          forwardValue(&instance->fields[i]);
+        }
+      }
+      if (instance->dictionary != NULL) {
+        forwardTable(instance->dictionary);
+      }
+      break;
+    }
+
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      FORWARD(shape->parent);
+      FORWARD(shape->name);
+      forwardTable(&shape->transitions);
+      break;
+    }
+
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      forwardValue(&upvalue->closed);
+      FORWARD(upvalue->next);
+      break;
+    }
+
+    case OBJ_LIST: {
+      forwardArray(&((ObjList*)object)->values);
+      break;
+    }
+
+    case OBJ_TABLE: {
+      forwardMap(&((ObjTable*)object)->values);
+      break;
+    }
+
+    case OBJ_ITERATOR: {
+      FORWARD(((ObjIterator*)object)->source);
+      break;
+    }
+
+    case OBJ_BUFFER:
+    case OBJ_NATIVE:
+    case OBJ_RANGE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+// The roots of the collector, less the fibers, and the weak references
+// of the intern table and the remembered set.
+static void forwardRoots() {
+  FORWARD(vm_.emptyShape);
+  FORWARD(vm_.listGetAt);
+  FORWARD(vm_.listSetAt);
+  FORWARD(vm_.tableGetAt);
+  FORWARD(vm_.tableSetAt);
+  FORWARD(vm_.listIter);
+  FORWARD(vm_.tableIter);
+  FORWARD(vm_.rangeIter);
+  FORWARD(vm_.iteratorIter);
+  forwardTable(&vm_.globals);
+  forwardTable(&vm_.strings);
+  forwardConstants();
+  for (int i = 0; i < vm_.rememberedCount; i++) {
+    FORWARD(vm_.remembered[i]);
+  }
+}
+
+// Collect garbage, then move objects out of sparse pages and release
+// them. Returns the number of bytes the collection freed.
+int compactHeap() {
+  int collected = collectGarbage();
+  vm_.compactPending = false;
+
+  int selected = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    selected += selectPages(&vm_.slabs.classes[i]);
+  }
+  if (selected == 0) {
+    return collected;
+  }
+
+  int pages = vm_.slabs.pageCount;
+  moved_ = 0;
+  slabBeginEvacuation(&vm_.slabs);
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (SlabPage* page = vm_.slabs.classes[i].pages; page != NULL; page = page->next) {
+      if (page->isEvacuating) {
+        slabEachInPage(page, moveObject);
+      }
+    }
+  }
+  forwardRoots();
+  slabEach(&vm_.slabs, forwardFields);
+  slabEndEvacuation(&vm_.slabs);
+  vm_.compactions++;
+
+  if (config_.dbg_gc) {
+    print("-- compact: moved %d objects, pages from %d to %d\n",
+          moved_, pages, vm_.slabs.pageCount);
+  }
+  return collected;
+}
@@ -0,0 +1,10 @@
+#ifndef compact_h
+#define compact_h
+
+#include "common.h"
+#include "value.h"
+
+void forwardValue(Value* value);
+int compactHeap();
+
+#endif
@@ -142,6 +142,13 @@ static bool check(TokenType type) {
   return parser_->current.type == type;
 }
 
+// Whether the token after the current one has the type, scanning it
+// from a copy of the scanner.
+static bool checkNext(TokenType type) {
+  Scanner scanner = parser_->scanner;
+  return scanToken(&scanner).type == type;
+}
+
 static bool match(TokenType type) {
   if (!check(type)) {
     return false;
@@ -239,6 +246,9 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction* function = current_->function;
+  if (!parser_->hadError) {
+    optimizeChunk(currentChunk());
+  }
 
   if (config_.dbg_code) {
     if (!parser_->hadError) {
@@ -270,8 +280,13 @@ static void endScope() {
   }
 }
 
+// Names are looked up in tables, so they are always interned.
 static Byte identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+  ObjString* string = copyString(name->start, name->length);
+  push(OBJ_VAL(string));
+  string = internString(string);
+  pop();
+  return makeConstant(OBJ_VAL(string));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -491,14 +506,12 @@ static void index_(bool canAssign) {
     expression();
     Token setAt = syntheticToken("setAt");
     Byte name = identifierConstant(&setAt);
-    emitBytes(OP_INVOKE, name);
-    emitByte(2);
+    emitBytes(OP_INDEX_SET, name);
   }
   else {
     Token getAt = syntheticToken("getAt");
     Byte name = identifierConstant(&getAt);
-    emitBytes(OP_INVOKE, name);
-    emitByte(1);
+    emitBytes(OP_INDEX_GET, name);
   }
 }
 
@@ -655,6 +668,7 @@ ParseRule rules[] = {
   [TOKEN_HASH]          = {unary,    binary, PREC_FACTOR},
   [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IN]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_CURLY]    = {unary,    NULL,   PREC_CALL},
   [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_LEFT_SQUARE]   = {unary,    index_, PREC_CALL},
@@ -834,9 +848,52 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
+// for (x in sequence) runs the body with x set to each value of
+// sequence in turn. OP_ITER_INIT replaces the sequence with an iterator,
+// which for a List, Table or Range is a native one, and otherwise is what
+// sequence.iter() returns. OP_ITER_NEXT pushes the iterator's next value,
+// or jumps out of the loop once it is done. It walks a native iterator
+// itself, and calls done() and next() on any other, keeping track of
+// which call it is waiting on in a second hidden local.
+static void forInStatement() {
+  consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+  Token name = parser_->previous;
+  consume(TOKEN_IN, "Expect 'in' after loop variable.");
+
+  // Locals that no name can refer to.
+  emitByte(OP_NIL);
+  addLocal(syntheticToken(" state"));
+  markInitialized();
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+  emitByte(OP_ITER_INIT);
+  addLocal(syntheticToken(" iterator"));
+  markInitialized();
+  Byte iterator = (Byte)(current_->localCount - 1);
+
+  int loopStart = currentChunk()->count;
+  int exitJump = emitJump(OP_ITER_NEXT);
+  emitByte(iterator);
+
+  // Each pass gets its own variable, for closures to capture.
+  beginScope();
+  addLocal(name);
+  markInitialized();
+  statement();
+  endScope();
+  emitLoop(loopStart);
+
+  patchJump(exitJump);
+}
+
 static void forStatement() {
   beginScope();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (check(TOKEN_IDENTIFIER) && checkNext(TOKEN_IN)) {
+    forInStatement();
+    endScope();
+    return;
+  }
   if (match(TOKEN_SEMICOLON)) {
     // No initializer.
   }
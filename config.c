@@ -8,7 +8,7 @@
 #include "memory.h"
 #include "vm.h"
 
-static const char* USAGE = "usage: loon [-c] [-g] [-l] [-m] [-x] [filename]";
+static const char* USAGE = "usage: loon [-c] [-d depth] [-f factor] [-g] [-h max] [-i initial] [-k percent] [-l] [-m] [-n min] [-o objects] [-p] [-s soft] [-t threads] [-u micros] [-x] [filename]";
 
 typedef struct LogMessage LogMessage;
 
@@ -44,24 +44,84 @@ Config config_ = {
   .dbg_exec = false,
   .dbg_gc = false,
   .dbg_memory = false,
+  .dbg_pauses = false,
+  .max_depth = 1024,
+  .gc_step_objects = 1000,
+  .gc_step_micros = 0,
+  .gc_threads = 1,
+  .gc_compact_percent = 0,
+  .gc_initial_heap = 1024 * 1024,
+  .gc_growth_factor = 2,
+  .gc_min_heap = 0,
+  .gc_max_heap = 0,
+  .gc_soft_heap = 0,
   .filename = NULL,
   .print = printImmediate
 };
 
+// A size in bytes, with an optional K, M or G suffix. Zero if malformed.
+static size_t parseSize(const char* text) {
+  char* end;
+  double size = strtod(text, &end);
+  switch (*end) {
+    case 'K': case 'k': size *= 1024; end++; break;
+    case 'M': case 'm': size *= 1024 * 1024; end++; break;
+    case 'G': case 'g': size *= 1024 * 1024 * 1024; end++; break;
+  }
+  if ((*end != '\0') || (size < 0)) {
+    return 0;
+  }
+  return (size_t)size;
+}
+
 void initConfig(int argc, const char* argv[]) {
   for (int i=1; i<argc; i++) {
     if (strcmp(argv[i], "-c") == 0) {
       config_.dbg_code = true;
     }
+    else if ((strcmp(argv[i], "-d") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0)) {
+      config_.max_depth = atoi(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-f") == 0) && (i + 1 < argc) && (atof(argv[i + 1]) > 1)) {
+      config_.gc_growth_factor = atof(argv[++i]);
+    }
     else if (strcmp(argv[i], "-g") == 0) {
       config_.dbg_gc = true;
     }
+    else if ((strcmp(argv[i], "-h") == 0) && (i + 1 < argc) && (parseSize(argv[i + 1]) > 0)) {
+      config_.gc_max_heap = parseSize(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-i") == 0) && (i + 1 < argc) && (parseSize(argv[i + 1]) > 0)) {
+      config_.gc_initial_heap = parseSize(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-k") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0)) {
+      config_.gc_compact_percent = atoi(argv[++i]);
+    }
     else if (strcmp(argv[i], "-l") == 0) {
       config_.print = printLog;
     }
     else if (strcmp(argv[i], "-m") == 0) {
       config_.dbg_memory = true;
     }
+    else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (parseSize(argv[i + 1]) > 0)) {
+      config_.gc_min_heap = parseSize(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0)) {
+      config_.gc_step_objects = atoi(argv[++i]);
+      config_.gc_step_micros = 0;
+    }
+    else if (strcmp(argv[i], "-p") == 0) {
+      config_.dbg_pauses = true;
+    }
+    else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc) && (parseSize(argv[i + 1]) > 0)) {
+      config_.gc_soft_heap = parseSize(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0)) {
+      config_.gc_threads = atoi(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "-u") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) > 0)) {
+      config_.gc_step_micros = atoi(argv[++i]);
+    }
     else if (strcmp(argv[i], "-x") == 0) {
       config_.dbg_exec = true;
     }
@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef void (*PrintFn)(const char* fmt, va_list ap);
 
@@ -11,6 +12,19 @@ typedef struct {
   bool dbg_exec;
   bool dbg_gc;
   bool dbg_memory;
+  bool dbg_pauses;
+  int max_depth;
+  int gc_step_objects;
+  int gc_step_micros;
+  int gc_threads;
+  int gc_compact_percent;
+  // Heap sizes in bytes. An embedder may set them before initVM(); changes
+  // to all but the initial heap apply from the end of the next collection.
+  size_t gc_initial_heap;   // Heap size of the first major collection.
+  double gc_growth_factor;  // Next collection at this times the live heap,
+  size_t gc_min_heap;       // but no lower than this
+  size_t gc_max_heap;       // nor higher than this, if set.
+  size_t gc_soft_heap;      // Past this, if set, grow by a quarter at most.
   const char* filename;
   PrintFn print;
 } Config;
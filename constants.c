@@ -1,3 +1,4 @@
+#include "compact.h"
 #include "constants.h"
 #include "memory.h"
 #include "object.h"
@@ -21,3 +22,9 @@ void markConstants() {
 #include "constants.inc"
 #undef CONSTANT_STRING
 }
+
+void forwardConstants() {
+#define CONSTANT_STRING(name, value) forwardValue(&name)
+#include "constants.inc"
+#undef CONSTANT_STRING
+}
@@ -9,5 +9,6 @@
 
 void initConstants();
 void markConstants();
+void forwardConstants();
 
 #endif
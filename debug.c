@@ -13,42 +13,52 @@ void disassembleChunk(Chunk* chunk, const char* name) {
   }
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
+static void constantInstruction(const char* name, Chunk* chunk, int offset) {
   Byte constant = chunk->code[offset + 1];
   print("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
   print("'\n");
-  return offset + 2;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+static void invokeInstruction(const char* name, Chunk* chunk, int offset) {
   Byte constant = chunk->code[offset + 1];
   Byte argCount = chunk->code[offset + 2];
   print("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
   print("'\n");
-  return offset + 3;
 }
 
-static int simpleInstruction(const char* name, int offset) {
+static void simpleInstruction(const char* name) {
   print("%s\n", name);
-  return offset + 1;
 }
 
-static int byteInstruction(const char* name, Chunk* chunk, int offset) {
+static void byteInstruction(const char* name, Chunk* chunk, int offset) {
   Byte slot = chunk->code[offset + 1];
   print("%-16s %4d\n", name, slot);
-  return offset + 2;
 }
 
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+static void localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+  Byte slot = chunk->code[offset + 1];
+  Byte constant = chunk->code[offset + 2];
+  print("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  print("'\n");
+}
+
+static void jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << BYTE_WIDTH);
   jump |= chunk->code[offset + 2];
   print("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-  return offset + 3;
 }
 
-static int closureInstruction(const char* name, Chunk* chunk, int offset) {
+static void iterNextInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << BYTE_WIDTH);
+  jump |= chunk->code[offset + 2];
+  Byte slot = chunk->code[offset + 3];
+  print("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 3 + jump);
+}
+
+static void closureInstruction(const char* name, Chunk* chunk, int offset) {
   offset++;
   Byte constant = chunk->code[offset++];
   print("%-16s %4d ", name, constant);
@@ -62,8 +72,6 @@ static int closureInstruction(const char* name, Chunk* chunk, int offset) {
     print("%04d      |                     %s %d\n",
 	  offset - 2, isLocal ? "local" : "upvalue", index);
   }
-
-  return offset;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
@@ -77,49 +85,64 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
   Byte instruction = chunk->code[offset];
   switch (instruction) {
-    case OP_ADD: return simpleInstruction("OP_ADD", offset);
-    case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
-    case OP_CALL_POSTFIX: return byteInstruction("OP_CALL_POSTFIX", chunk, offset);
-    case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset);
-    case OP_CLOSURE: return closureInstruction("OP_CLOSURE", chunk, offset);
-    case OP_COLLECTION_LIST: return simpleInstruction("OP_COLLECTION_LIST", offset);
-    case OP_COLLECTION_TABLE: return simpleInstruction("OP_COLLECTION_TABLE", offset);
-    case OP_CONSTANT: return constantInstruction("OP_CONSTANT", chunk, offset);
-    case OP_DIVIDE: return simpleInstruction("OP_DIVIDE", offset);
-    case OP_EQUAL: return simpleInstruction("OP_EQUAL", offset);
-    case OP_FALSE: return simpleInstruction("OP_FALSE", offset);
-    case OP_GLOBAL_DEFINE: return constantInstruction("OP_GLOBAL_DEFINE", chunk, offset);
-    case OP_GLOBAL_GET: return constantInstruction("OP_GLOBAL_GET", chunk, offset);
-    case OP_GLOBAL_SET: return constantInstruction("OP_GLOBAL_SET", chunk, offset);
-    case OP_GREATER: return simpleInstruction("OP_GREATER", offset);
-    case OP_INHERIT: return simpleInstruction("OP_INHERIT", offset);
-    case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
-    case OP_INVOKE_SUPER: return invokeInstruction("OP_INVOKE_SUPER", chunk, offset);
-    case OP_JUMP: return jumpInstruction("OP_JUMP", 1, chunk, offset);
-    case OP_JUMP_IF_FALSE: return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-    case OP_LESS: return simpleInstruction("OP_LESS", offset);
-    case OP_LOCAL_GET: return byteInstruction("OP_LOCAL_GET", chunk, offset);
-    case OP_LOCAL_SET: return byteInstruction("OP_LOCAL_SET", chunk, offset);
-    case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
-    case OP_METHOD: return constantInstruction("OP_METHOD", chunk, offset);
-    case OP_MULTIPLY: return simpleInstruction("OP_MULTIPLY", offset);
-    case OP_NEGATE: return simpleInstruction("OP_NEGATE", offset);
-    case OP_NIL: return simpleInstruction("OP_NIL", offset);
-    case OP_NOT: return simpleInstruction("OP_NOT", offset);
-    case OP_POP: return simpleInstruction("OP_POP", offset);
-    case OP_PROPERTY_GET: return constantInstruction("OP_PROPERTY_GET", chunk, offset);
-    case OP_PROPERTY_SET: return constantInstruction("OP_PROPERTY_SET", chunk, offset);
-    case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
-    case OP_SUBTRACT: return simpleInstruction("OP_SUBTRACT", offset);
-    case OP_SUPER_GET: return constantInstruction("OP_SUPER_GET", chunk, offset);
-    case OP_TRUE: return simpleInstruction("OP_TRUE", offset);
-    case OP_UPVALUE_CLOSE: return simpleInstruction("OP_UPVALUE_CLOSE", offset);
-    case OP_UPVALUE_GET: return byteInstruction("OP_UPVALUE_GET", chunk, offset);
-    case OP_UPVALUE_SET: return byteInstruction("OP_UPVALUE_SET", chunk, offset);
+    case OP_ADD: simpleInstruction("OP_ADD"); break;
+    case OP_ADD_LOCAL_CONSTANT: localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset); break;
+    case OP_CALL: byteInstruction("OP_CALL", chunk, offset); break;
+    case OP_CALL_POSTFIX: byteInstruction("OP_CALL_POSTFIX", chunk, offset); break;
+    case OP_CLASS: constantInstruction("OP_CLASS", chunk, offset); break;
+    case OP_CLOSURE: closureInstruction("OP_CLOSURE", chunk, offset); break;
+    case OP_COLLECTION_LIST: byteInstruction("OP_COLLECTION_LIST", chunk, offset); break;
+    case OP_COLLECTION_TABLE: byteInstruction("OP_COLLECTION_TABLE", chunk, offset); break;
+    case OP_CONSTANT: constantInstruction("OP_CONSTANT", chunk, offset); break;
+    case OP_DIVIDE: simpleInstruction("OP_DIVIDE"); break;
+    case OP_EQUAL: simpleInstruction("OP_EQUAL"); break;
+    case OP_EQUAL_JUMP_IF_FALSE: jumpInstruction("OP_EQUAL_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_FALSE: simpleInstruction("OP_FALSE"); break;
+    case OP_GLOBAL_DEFINE: constantInstruction("OP_GLOBAL_DEFINE", chunk, offset); break;
+    case OP_GLOBAL_GET: constantInstruction("OP_GLOBAL_GET", chunk, offset); break;
+    case OP_GLOBAL_SET: constantInstruction("OP_GLOBAL_SET", chunk, offset); break;
+    case OP_GREATER: simpleInstruction("OP_GREATER"); break;
+    case OP_GREATER_EQUAL: simpleInstruction("OP_GREATER_EQUAL"); break;
+    case OP_GREATER_EQUAL_JUMP_IF_FALSE: jumpInstruction("OP_GREATER_EQUAL_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_GREATER_JUMP_IF_FALSE: jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_INHERIT: simpleInstruction("OP_INHERIT"); break;
+    case OP_INDEX_GET: constantInstruction("OP_INDEX_GET", chunk, offset); break;
+    case OP_INDEX_SET: constantInstruction("OP_INDEX_SET", chunk, offset); break;
+    case OP_INVOKE: invokeInstruction("OP_INVOKE", chunk, offset); break;
+    case OP_INVOKE_SUPER: invokeInstruction("OP_INVOKE_SUPER", chunk, offset); break;
+    case OP_ITER_INIT: simpleInstruction("OP_ITER_INIT"); break;
+    case OP_ITER_NEXT: iterNextInstruction("OP_ITER_NEXT", chunk, offset); break;
+    case OP_JUMP: jumpInstruction("OP_JUMP", 1, chunk, offset); break;
+    case OP_JUMP_IF_FALSE: jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_LESS: simpleInstruction("OP_LESS"); break;
+    case OP_LESS_EQUAL: simpleInstruction("OP_LESS_EQUAL"); break;
+    case OP_LESS_EQUAL_JUMP_IF_FALSE: jumpInstruction("OP_LESS_EQUAL_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_LESS_JUMP_IF_FALSE: jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_LOCAL_GET: byteInstruction("OP_LOCAL_GET", chunk, offset); break;
+    case OP_LOCAL_SET: byteInstruction("OP_LOCAL_SET", chunk, offset); break;
+    case OP_LOOP: jumpInstruction("OP_LOOP", -1, chunk, offset); break;
+    case OP_METHOD: constantInstruction("OP_METHOD", chunk, offset); break;
+    case OP_MULTIPLY: simpleInstruction("OP_MULTIPLY"); break;
+    case OP_NEGATE: simpleInstruction("OP_NEGATE"); break;
+    case OP_NIL: simpleInstruction("OP_NIL"); break;
+    case OP_NOT: simpleInstruction("OP_NOT"); break;
+    case OP_NOT_EQUAL: simpleInstruction("OP_NOT_EQUAL"); break;
+    case OP_NOT_EQUAL_JUMP_IF_FALSE: jumpInstruction("OP_NOT_EQUAL_JUMP_IF_FALSE", 1, chunk, offset); break;
+    case OP_POP: simpleInstruction("OP_POP"); break;
+    case OP_PROPERTY_GET: constantInstruction("OP_PROPERTY_GET", chunk, offset); break;
+    case OP_PROPERTY_SET: constantInstruction("OP_PROPERTY_SET", chunk, offset); break;
+    case OP_RETURN: simpleInstruction("OP_RETURN"); break;
+    case OP_SUBTRACT: simpleInstruction("OP_SUBTRACT"); break;
+    case OP_SUPER_GET: constantInstruction("OP_SUPER_GET", chunk, offset); break;
+    case OP_TRUE: simpleInstruction("OP_TRUE"); break;
+    case OP_UPVALUE_CLOSE: simpleInstruction("OP_UPVALUE_CLOSE"); break;
+    case OP_UPVALUE_GET: byteInstruction("OP_UPVALUE_GET", chunk, offset); break;
+    case OP_UPVALUE_SET: byteInstruction("OP_UPVALUE_SET", chunk, offset); break;
     default:
       print("Unknown opcode %d\n", instruction);
-      return offset + 1;
+      break;
   }
+  return offset + instructionLength(chunk, offset);
 }
 
 void traceExecution(ObjFiber* fiber, CallFrame* frame) {
@@ -134,11 +157,13 @@ void traceExecution(ObjFiber* fiber, CallFrame* frame) {
                          (int)(frame->ip - frame->closure->function->chunk.code));
 }
 
+static void printObject(void* slot) {
+  Obj* obj = (Obj*)slot;
+  print("%p %d %s ", obj, obj->type, objectTypeName(obj->type));
+  printValue(OBJ_VAL(obj));
+  print("\n");
+}
+
 void printAllObjects() {
-  for (Obj* obj = vm_.objects; obj != NULL; obj = obj->next) {
-    Value value = OBJ_VAL(obj);
-    print("%p %d %s ", obj, obj->type, objectTypeName(obj->type));
-    printValue(value);
-    print("\n");
-  }
+  slabEach(&vm_.slabs, printObject);
 }
@@ -0,0 +1,278 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HASH_ARM
+#endif
+
+// Strings are hashed a word at a time, mixing with the 128-bit product
+// of two words as wyhash does. Long strings go through eight 64-bit
+// lanes, 64 bytes at a time, in the manner of XXH3, which is where the
+// vector code paths come in.
+
+#define HASH_LANES 8
+#define HASH_STRIPE (HASH_LANES * 8)
+
+// Strings longer than this use the lanes.
+#define HASH_LONG 256
+
+// Stripes between two scrambles of the lanes.
+#define HASH_BLOCK_STRIPES 16
+
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_32 0x9E3779B1U
+
+static const uint64_t secret_[HASH_LANES] __attribute__((aligned(32))) = {
+  0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+  0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+  0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+  0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+static const uint64_t mergeSecret_[HASH_LANES] = {
+  0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL,
+  0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+  0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL,
+  0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL
+};
+
+static inline uint64_t read64(const char* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  return h ^ (h >> 32);
+}
+
+// Up to 16 bytes, read as two words that may overlap.
+static uint64_t hashShort(const char* p, int length) {
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if (length >= 8) {
+    a = read64(p);
+    b = read64(p + length - 8);
+  }
+  else if (length >= 4) {
+    a = read32(p);
+    b = read32(p + length - 4);
+  }
+  else if (length > 0) {
+    a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[length >> 1] << 8) |
+      (uint8_t)p[length - 1];
+  }
+  return mix(a ^ secret_[0] ^ (uint64_t)length, b ^ secret_[1]);
+}
+
+// Up to HASH_LONG bytes, 16 at a time, then the last 16.
+static uint64_t hashMedium(const char* p, int length) {
+  uint64_t h = (uint64_t)length * PRIME_1;
+  int i = 0;
+  for (; i + 16 < length; i += 16) {
+    h = mix(read64(p + i) ^ secret_[2] ^ h, read64(p + i + 8) ^ secret_[3]);
+  }
+  return mix(read64(p + length - 16) ^ secret_[4] ^ h, read64(p + length - 8) ^ secret_[5]);
+}
+
+// Each lane adds its word and the product of the word's halves, after
+// the word is combined with the lane's secret.
+typedef void (*AccumulateFn)(uint64_t* acc, const char* p, int stripes);
+
+static void accumulateScalar(uint64_t* acc, const char* p, int stripes) {
+  for (int s = 0; s < stripes; s++, p += HASH_STRIPE) {
+    for (int i = 0; i < HASH_LANES; i++) {
+      uint64_t value = read64(p + 8 * i);
+      uint64_t key = value ^ secret_[i];
+      acc[i] += value + (key & 0xffffffff) * (key >> 32);
+    }
+  }
+}
+
+#ifdef HASH_X86
+__attribute__((target("sse2")))
+static void accumulateSse2(uint64_t* acc, const char* p, int stripes) {
+  __m128i lanes[4];
+  for (int i = 0; i < 4; i++) {
+    lanes[i] = _mm_loadu_si128((const __m128i*)acc + i);
+  }
+  for (int s = 0; s < stripes; s++, p += HASH_STRIPE) {
+    for (int i = 0; i < 4; i++) {
+      __m128i value = _mm_loadu_si128((const __m128i*)p + i);
+      __m128i key = _mm_xor_si128(value, _mm_load_si128((const __m128i*)secret_ + i));
+      __m128i high = _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+      lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(value, _mm_mul_epu32(key, high)));
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    _mm_storeu_si128((__m128i*)acc + i, lanes[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void accumulateAvx2(uint64_t* acc, const char* p, int stripes) {
+  __m256i lanes[2];
+  for (int i = 0; i < 2; i++) {
+    lanes[i] = _mm256_loadu_si256((const __m256i*)acc + i);
+  }
+  for (int s = 0; s < stripes; s++, p += HASH_STRIPE) {
+    for (int i = 0; i < 2; i++) {
+      __m256i value = _mm256_loadu_si256((const __m256i*)p + i);
+      __m256i key = _mm256_xor_si256(value, _mm256_load_si256((const __m256i*)secret_ + i));
+      __m256i high = _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+      lanes[i] = _mm256_add_epi64(lanes[i], _mm256_add_epi64(value, _mm256_mul_epu32(key, high)));
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    _mm256_storeu_si256((__m256i*)acc + i, lanes[i]);
+  }
+}
+#endif
+
+#ifdef HASH_ARM
+static void accumulateNeon(uint64_t* acc, const char* p, int stripes) {
+  uint64x2_t lanes[4];
+  for (int i = 0; i < 4; i++) {
+    lanes[i] = vld1q_u64(acc + 2 * i);
+  }
+  for (int s = 0; s < stripes; s++, p += HASH_STRIPE) {
+    for (int i = 0; i < 4; i++) {
+      uint64x2_t value = vreinterpretq_u64_u8(vld1q_u8((const uint8_t*)p + 16 * i));
+      uint64x2_t key = veorq_u64(value, vld1q_u64(secret_ + 2 * i));
+      uint64x2_t product = vmull_u32(vmovn_u64(key), vshrn_n_u64(key, 32));
+      lanes[i] = vaddq_u64(lanes[i], vaddq_u64(value, product));
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    vst1q_u64(acc + 2 * i, lanes[i]);
+  }
+}
+#endif
+
+static const AccumulateFn accumulators_[HASH_PATHS] = {
+  [HASH_SCALAR] = accumulateScalar,
+#ifdef HASH_X86
+  [HASH_SSE2] = accumulateSse2,
+  [HASH_AVX2] = accumulateAvx2,
+#endif
+#ifdef HASH_ARM
+  [HASH_NEON] = accumulateNeon,
+#endif
+};
+
+static const char* pathNames_[HASH_PATHS] = {
+  [HASH_SCALAR] = "scalar",
+  [HASH_SSE2] = "sse2",
+  [HASH_AVX2] = "avx2",
+  [HASH_NEON] = "neon"
+};
+
+// Chosen on first use, from the best path the processor supports.
+static HashPath path_ = HASH_PATHS;
+
+bool hashPathSupported(HashPath path) {
+  if ((path >= HASH_PATHS) || (accumulators_[path] == NULL)) {
+    return false;
+  }
+#ifdef HASH_X86
+  if (path == HASH_AVX2) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return true;
+}
+
+bool useHashPath(HashPath path) {
+  if (!hashPathSupported(path)) {
+    return false;
+  }
+  path_ = path;
+  return true;
+}
+
+HashPath currentHashPath() {
+  if (path_ == HASH_PATHS) {
+    static const HashPath preferred[] = {HASH_AVX2, HASH_SSE2, HASH_NEON, HASH_SCALAR};
+    for (int i = 0; !useHashPath(preferred[i]); i++) {
+    }
+  }
+  return path_;
+}
+
+const char* hashPathName(HashPath path) {
+  return (path < HASH_PATHS) ? pathNames_[path] : "unknown";
+}
+
+// Keep the lanes from settling, and spread their high bits down.
+static void scramble(uint64_t* acc) {
+  for (int i = 0; i < HASH_LANES; i++) {
+    acc[i] = (acc[i] ^ (acc[i] >> 47) ^ secret_[i]) * PRIME_32;
+  }
+}
+
+static uint64_t hashLong(const char* p, int length) {
+  AccumulateFn accumulate = accumulators_[currentHashPath()];
+  uint64_t acc[HASH_LANES] = {
+    PRIME_32, PRIME_1, PRIME_2, PRIME_1 ^ PRIME_2,
+    PRIME_2 ^ PRIME_32, PRIME_1 + PRIME_32, PRIME_2 + PRIME_1, PRIME_32 ^ PRIME_1
+  };
+
+  // The last stripe, which may overlap the others, is always taken
+  // whole.
+  const char* last = p + length - HASH_STRIPE;
+  int stripes = (length - 1) / HASH_STRIPE;
+  const char* end = p + (size_t)stripes * HASH_STRIPE;
+  while (p < end) {
+    int count = (int)((end - p) / HASH_STRIPE);
+    if (count > HASH_BLOCK_STRIPES) {
+      count = HASH_BLOCK_STRIPES;
+    }
+    accumulate(acc, p, count);
+    p += (size_t)count * HASH_STRIPE;
+    if (count == HASH_BLOCK_STRIPES) {
+      scramble(acc);
+    }
+  }
+  accumulateScalar(acc, last, 1);
+
+  uint64_t h = (uint64_t)length * PRIME_1;
+  for (int i = 0; i < HASH_LANES; i += 2) {
+    h += mix(acc[i] ^ mergeSecret_[i], acc[i + 1] ^ mergeSecret_[i + 1]);
+  }
+  return h;
+}
+
+uint32_t hashBytes(const char* chars, int length) {
+  uint64_t h;
+  if (length <= 16) {
+    h = hashShort(chars, length);
+  }
+  else if (length <= HASH_LONG) {
+    h = hashMedium(chars, length);
+  }
+  else {
+    h = hashLong(chars, length);
+  }
+  h = avalanche(h);
+  return (uint32_t)(h ^ (h >> 32));
+}
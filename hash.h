@@ -0,0 +1,33 @@
+#ifndef hash_h
+#define hash_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Ways of hashing long strings. Every path gives the same hashes, the
+// vector ones only faster.
+typedef enum {
+  HASH_SCALAR,
+  HASH_SSE2,
+  HASH_AVX2,
+  HASH_NEON,
+  HASH_PATHS
+} HashPath;
+
+uint32_t hashBytes(const char* chars, int length);
+
+// A 64-bit word such as a pointer or the bits of a double, spread over 32
+// bits.
+static inline uint32_t hashWord(uint64_t word) {
+  word ^= word >> 33;
+  word *= 0xff51afd7ed558ccdULL;
+  word ^= word >> 33;
+  return (uint32_t)word;
+}
+
+bool hashPathSupported(HashPath path);
+bool useHashPath(HashPath path);
+HashPath currentHashPath();
+const char* hashPathName(HashPath path);
+
+#endif
@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "common.h"
+#include "list.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+// A list's items are a run in its array with free slots kept before them
+// as well as after, in the manner of a deque. values.values points at the
+// first item, so the items can be indexed directly, and values.capacity
+// counts the slots from there to the end of the array. 'front' counts
+// the free slots before the first item.
+//
+// Adding or removing an item moves whichever of the items before it or
+// after it are fewer. The array grows only when both ends are mostly
+// full: otherwise the items are slid along it, so a list used as a queue
+// keeps reusing the same array.
+//
+// The value being added must be reachable, since growing the array may
+// collect garbage.
+
+static inline Value* arrayOf(ObjList* list) {
+  return (list->values.values == NULL) ? NULL : list->values.values - list->front;
+}
+
+static inline int arraySize(ObjList* list) {
+  return list->front + list->values.capacity;
+}
+
+void freeListItems(ObjList* list) {
+  FREE_ARRAY(Value, arrayOf(list), arraySize(list));
+  initValueArray(&list->values);
+  list->front = 0;
+}
+
+// Place the items 'front' slots into their array.
+static void slideItems(ObjList* list, int front) {
+  Value* array = arrayOf(list);
+  int size = arraySize(list);
+  memmove(array + front, list->values.values, list->values.count * sizeof(Value));
+  list->values.values = array + front;
+  list->values.capacity = size - front;
+  list->front = front;
+}
+
+static void makeRoomAtEnd(ObjList* list) {
+  int count = list->values.count;
+  if (count < list->values.capacity) {
+    return;
+  }
+  if (list->front > count) {
+    slideItems(list, 0);
+    return;
+  }
+
+  int size = arraySize(list);
+  int newSize = GROW_CAPACITY(size);
+  Value* array = GROW_ARRAY(Value, arrayOf(list), size, newSize);
+  list->values.values = array + list->front;
+  list->values.capacity = newSize - list->front;
+}
+
+// Free slots are split evenly between the ends when the items move to
+// make room at the front.
+static void makeRoomAtFront(ObjList* list) {
+  if (list->front > 0) {
+    return;
+  }
+  int count = list->values.count;
+  int spare = list->values.capacity - count;
+  if (spare > count) {
+    slideItems(list, (spare + 1) / 2);
+    return;
+  }
+
+  int newSize = GROW_CAPACITY(arraySize(list));
+  int front = (newSize - count + 1) / 2;
+  Value* array = ALLOCATE(Value, newSize);
+  if (count > 0) {
+    memcpy(array + front, list->values.values, count * sizeof(Value));
+  }
+  FREE_ARRAY(Value, arrayOf(list), arraySize(list));
+  list->values.values = array + front;
+  list->values.capacity = newSize - front;
+  list->front = front;
+}
+
+void listAppend(ObjList* list, Value value) {
+  makeRoomAtEnd(list);
+  list->values.values[list->values.count++] = value;
+}
+
+// 'index' must be from 0 to the number of items.
+void listInsert(ObjList* list, int index, Value value) {
+  int count = list->values.count;
+  if (index < count / 2) {
+    makeRoomAtFront(list);
+    list->values.values--;
+    list->values.capacity++;
+    list->front--;
+    memmove(list->values.values, list->values.values + 1, index * sizeof(Value));
+  }
+  else {
+    makeRoomAtEnd(list);
+    Value* at = list->values.values + index;
+    memmove(at + 1, at, (count - index) * sizeof(Value));
+  }
+  list->values.values[index] = value;
+  list->values.count++;
+}
+
+// 'index' must be that of an item. A list left empty starts again at the
+// start of its array.
+void listRemove(ObjList* list, int index) {
+  int count = list->values.count;
+  Value* values = list->values.values;
+  if (index < count / 2) {
+    memmove(values + 1, values, index * sizeof(Value));
+    list->values.values++;
+    list->values.capacity--;
+    list->front++;
+  }
+  else {
+    memmove(values + index, values + index + 1, (count - index - 1) * sizeof(Value));
+  }
+  list->values.count--;
+  if (list->values.count == 0) {
+    slideItems(list, 0);
+  }
+}
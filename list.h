@@ -0,0 +1,16 @@
+#ifndef list_h
+#define list_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// The storage of the built-in List class. Items can be added and removed
+// at either end in constant time, so a list also serves as a queue.
+
+void freeListItems(ObjList* list);
+void listAppend(ObjList* list, Value value);
+void listInsert(ObjList* list, int index, Value value);
+void listRemove(ObjList* list, int index);
+
+#endif
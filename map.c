@@ -0,0 +1,296 @@
+#include <math.h>
+#include <string.h>
+
+#include "common.h"
+#include "hash.h"
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#define MAP_MAX_LOAD 0.75
+
+// Maps are laid out like ordered dicts: the entries are a dense array in
+// the order their keys were added, which iteration walks straight
+// through, and the index over them is a Robin Hood hash table like a
+// Table, of slots small enough to fit eight to a cache line. Each slot
+// keeps its key's hash, since only strings carry their own.
+//
+// Keys are stored in a canonical form, so that keys which are equal are
+// also identical: strings are interned, -0 is stored as 0, and every NaN
+// as the same NaN, which unlike in comparisons finds itself. Other
+// objects are keys by identity, hashed by address, so a map holding one
+// must be rehashed when the heap is compacted.
+
+static inline uint64_t keyBits(Value key) {
+#ifdef NAN_BOXING
+  return key;
+#else
+  switch (key.type) {
+    case VAL_BOOL: return key.as.boolean;
+    case VAL_NIL: return 0;
+    case VAL_NUMBER: {
+      uint64_t bits;
+      memcpy(&bits, &key.as.number, sizeof(bits));
+      return bits;
+    }
+    case VAL_OBJ: return (uint64_t)(uintptr_t)key.as.obj;
+  }
+  return 0;
+#endif
+}
+
+static inline bool keysEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  return (a.type == b.type) && (keyBits(a) == keyBits(b));
+#endif
+}
+
+static inline uint32_t hashKey(Value key) {
+  return IS_STRING(key) ? AS_STRING(key)->hash : hashWord(keyBits(key));
+}
+
+static inline Value canonicalNumber(double number) {
+  if (number == 0) {
+    return NUMBER_VAL(0);
+  }
+  if (isnan(number)) {
+    return NUMBER_VAL(NAN);
+  }
+  return NUMBER_VAL(number);
+}
+
+// The form a key is stored in. It may allocate, so the key must be
+// reachable.
+Value mapKey(Value key) {
+  if (IS_STRING(key)) {
+    return OBJ_VAL(internString(AS_STRING(key)));
+  }
+  if (IS_NUMBER(key)) {
+    return canonicalNumber(AS_NUMBER(key));
+  }
+  return key;
+}
+
+// The stored form of a key, without allocating. Returns false if no map
+// can hold the key, because it is a string that isn't interned.
+static inline bool lookupKey(Value* key) {
+  if (IS_STRING(*key)) {
+    ObjString* string = findString(AS_STRING(*key));
+    if (string == NULL) {
+      return false;
+    }
+    *key = OBJ_VAL(string);
+  }
+  else if (IS_NUMBER(*key)) {
+    *key = canonicalNumber(AS_NUMBER(*key));
+  }
+  return true;
+}
+
+void initMap(Map* map) {
+  map->count = 0;
+  map->used = 0;
+  map->capacity = 0;
+  map->slotCount = 0;
+  map->version = 0;
+  map->entries = NULL;
+  map->slots = NULL;
+}
+
+void freeMap(Map* map) {
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  FREE_ARRAY(MapSlot, map->slots, map->slotCount);
+  initMap(map);
+}
+
+void printMap(Map* map) {
+  for (int i=0; i<map->used; i++) {
+    if (IS_EMPTY_KEY(map->entries[i].key)) {
+      print("%04d -deleted-\n", i);
+    }
+    else {
+      print("%04d ", i);
+      printValue(map->entries[i].key);
+      print(" ");
+      printValue(map->entries[i].value);
+      print("\n");
+    }
+  }
+}
+
+// How far the slot at 'index' is from its home.
+static inline uint32_t probeDistance(Map* map, uint32_t index) {
+  return (index - map->slots[index].hash) & (map->slotCount - 1);
+}
+
+static MapSlot* findSlot(Map* map, Value key, uint32_t hash) {
+  uint32_t mask = map->slotCount - 1;
+  uint32_t index = hash & mask;
+  for (uint32_t distance = 0; ; distance++) {
+    MapSlot* slot = &map->slots[index];
+    if ((slot->position < 0) || (probeDistance(map, index) < distance)) {
+      return NULL;
+    }
+    if ((slot->hash == hash) && keysEqual(map->entries[slot->position].key, key)) {
+      return slot;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+// Index the entry at 'position', whose key isn't in the index yet.
+static void insertSlot(Map* map, uint32_t hash, int position) {
+  MapSlot carried = {hash, position};
+  uint32_t mask = map->slotCount - 1;
+  uint32_t index = hash & mask;
+  for (uint32_t distance = 0; ; distance++) {
+    MapSlot* slot = &map->slots[index];
+    if (slot->position < 0) {
+      *slot = carried;
+      return;
+    }
+
+    uint32_t existing = probeDistance(map, index);
+    if (existing < distance) {
+      MapSlot evicted = *slot;
+      *slot = carried;
+      carried = evicted;
+      distance = existing;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+static void buildIndex(Map* map) {
+  for (int i = 0; i < map->slotCount; i++) {
+    map->slots[i].hash = 0;
+    map->slots[i].position = -1;
+  }
+  for (int i = 0; i < map->used; i++) {
+    if (!IS_EMPTY_KEY(map->entries[i].key)) {
+      insertSlot(map, hashKey(map->entries[i].key), i);
+    }
+  }
+}
+
+bool mapGet(Map* map, Value key, Value* value) {
+  if ((map->count == 0) || !lookupKey(&key)) {
+    return false;
+  }
+
+  MapSlot* slot = findSlot(map, key, hashKey(key));
+  if (slot == NULL) {
+    return false;
+  }
+  *value = map->entries[slot->position].value;
+  return true;
+}
+
+// Move the entries to a new array, without the holes, and index them
+// again in 'slotCount' slots.
+static void resize(Map* map, int slotCount) {
+  int capacity = (int)(slotCount * MAP_MAX_LOAD);
+  MapEntry* entries = ALLOCATE(MapEntry, capacity);
+  int used = 0;
+  for (int i = 0; i < map->used; i++) {
+    if (!IS_EMPTY_KEY(map->entries[i].key)) {
+      entries[used++] = map->entries[i];
+    }
+  }
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  map->entries = entries;
+  map->capacity = capacity;
+  map->used = used;
+
+  if (slotCount != map->slotCount) {
+    FREE_ARRAY(MapSlot, map->slots, map->slotCount);
+    map->slots = ALLOCATE(MapSlot, slotCount);
+    map->slotCount = slotCount;
+  }
+  buildIndex(map);
+}
+
+// The key must be in the form mapKey() gives.
+bool mapSet(Map* map, Value key, Value value) {
+  uint32_t hash = hashKey(key);
+  if (map->count > 0) {
+    MapSlot* slot = findSlot(map, key, hash);
+    if (slot != NULL) {
+      map->entries[slot->position].value = value;
+      return false;
+    }
+  }
+
+  // When the entries are full, make room by dropping the holes if at
+  // least half of them are, and by doubling the map if not.
+  if (map->used == map->capacity) {
+    int slotCount = map->slotCount;
+    if ((map->count + 1) * 2 > map->capacity) {
+      slotCount = GROW_CAPACITY(slotCount);
+    }
+    resize(map, slotCount);
+  }
+  map->entries[map->used].key = key;
+  map->entries[map->used].value = value;
+  insertSlot(map, hash, map->used);
+  map->used++;
+  map->count++;
+  map->version++;
+  return true;
+}
+
+bool mapDelete(Map* map, Value key) {
+  if ((map->count == 0) || !lookupKey(&key)) {
+    return false;
+  }
+  MapSlot* slot = findSlot(map, key, hashKey(key));
+  if (slot == NULL) {
+    return false;
+  }
+
+  MapEntry* entry = &map->entries[slot->position];
+  entry->key = EMPTY_KEY;
+  entry->value = NIL_VAL;
+  while ((map->used > 0) && IS_EMPTY_KEY(map->entries[map->used - 1].key)) {
+    map->used--;
+  }
+
+  // Shift the following slots back until one is empty or already in its
+  // home.
+  uint32_t mask = map->slotCount - 1;
+  uint32_t index = (uint32_t)(slot - map->slots);
+  for (;;) {
+    uint32_t next = (index + 1) & mask;
+    if ((map->slots[next].position < 0) || (probeDistance(map, next) == 0)) {
+      break;
+    }
+    map->slots[index] = map->slots[next];
+    index = next;
+  }
+  map->slots[index].hash = 0;
+  map->slots[index].position = -1;
+  map->count--;
+  map->version++;
+  return true;
+}
+
+// Index the keys again, after compaction has moved objects used as keys.
+// The entries stay where they are, so nothing is allocated.
+void rehashMap(Map* map) {
+  if (map->slotCount > 0) {
+    buildIndex(map);
+  }
+}
+
+void markMap(Map* map) {
+  for (int i = 0; i < map->used; i++) {
+    MapEntry* entry = &map->entries[i];
+    if (!IS_EMPTY_KEY(entry->key)) {
+      markValue(entry->key);
+      markValue(entry->value);
+    }
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef map_h
+#define map_h
+
+#include "common.h"
+#include "value.h"
+
+// The hash table behind the built-in Table class, whose keys can be any
+// value. The Table in table.h, keyed by interned strings, still serves
+// globals, methods and fields.
+
+// The key of a deleted entry, which no value can be.
+#ifdef NAN_BOXING
+#define EMPTY_KEY ((Value)QNAN)
+#define IS_EMPTY_KEY(key) ((key) == EMPTY_KEY)
+#else
+#define EMPTY_KEY ((Value){VAL_NIL, {.number = 1}})
+#define IS_EMPTY_KEY(key) (IS_NIL(key) && ((key).as.number == 1))
+#endif
+
+typedef struct {
+  Value key;
+  Value value;
+} MapEntry;
+
+// A slot of the index, holding the position of an entry and its key's
+// hash. An empty slot has a negative position.
+typedef struct {
+  uint32_t hash;
+  int32_t position;
+} MapSlot;
+
+// The entries are kept in the order their keys were added, deleted ones
+// left in place as holes until the entries are next reallocated. The
+// index is a hash table of positions in the entries.
+typedef struct {
+  int count;         // Keys in the map.
+  int used;          // Entries used, holes included.
+  int capacity;      // Room for entries.
+  int slotCount;     // Slots in the index, a power of two.
+  uint32_t version;  // Changes whenever a key is added or deleted.
+  MapEntry* entries;
+  MapSlot* slots;
+} Map;
+
+void initMap(Map* map);
+void freeMap(Map* map);
+void printMap(Map* map);
+Value mapKey(Value key);
+bool mapGet(Map* map, Value key, Value* value);
+bool mapSet(Map* map, Value key, Value value);
+bool mapDelete(Map* map, Value key);
+void rehashMap(Map* map);
+
+void markMap(Map* map);
+
+// The position of the first entry at or after 'position' that isn't a
+// hole, or 'used' if there is none.
+static inline int mapLiveFrom(Map* map, int position) {
+  while ((position < map->used) && IS_EMPTY_KEY(map->entries[position].key)) {
+    position++;
+  }
+  return position;
+}
+
+#endif
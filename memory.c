@@ -1,24 +1,99 @@
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "config.h"
 #include "constants.h"
 #include "debug.h"
+#include "list.h"
 #include "memory.h"
 #include "native.h"
+#include "shape.h"
 #include "table.h"
 #include "vm.h"
 
-#define GC_HEAP_GROW_FACTOR 2
+// Past the soft heap size, the heap grows by at most this factor.
+#define GC_SOFT_GROWTH_FACTOR 1.25
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+// Units of work between clock reads when the step budget is in microseconds.
+#define GC_CLOCK_INTERVAL 32
+
+// Fewest pages a compaction must be able to free to be triggered.
+#define GC_COMPACT_MIN_PAGES 16
+
+// A marking thread shares half of its gray objects once it holds more
+// than this many and its deque is empty.
+#define GC_SHARE_THRESHOLD 64
+
+typedef struct {
+  int count;
+  int capacity;
+  Obj** objects;
+} GrayStack;
+
+// Parallel marking: each thread drains a private gray stack, and moves
+// work to its deque for idle threads to steal.
+typedef struct {
+  GrayStack local;
+  GrayStack deque;
+  int dequeCount; // Read without the lock, as a hint.
+  pthread_mutex_t lock;
+} MarkWorker;
+
+static MarkWorker* workers_ = NULL;
+static int workerCount_ = 0;
+static int idleWorkers_ = 0;
+static pthread_mutex_t rememberLock_ = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local MarkWorker* worker_ = NULL;
+
+// Parallel sweeping: the threads take pages from a shared array. Dead
+// strings must leave the intern table, which only the calling thread
+// touches, so they are freed after the threads are done.
+typedef struct {
+  GrayStack strings;
+  size_t liveBytes[OBJ_TYPE_COUNT];
+} SweepWorker;
+
+static SlabPage** sweepPages_ = NULL;
+static int sweepPageCount_ = 0;
+static int nextSweepPage_ = 0;
+static _Thread_local SweepWorker* sweeper_ = NULL;
+
+// Bytes of the objects found alive by the sweep in progress, by type.
+static size_t sweptLive_[OBJ_TYPE_COUNT];
+
+static void startCycle();
+static void collectStep();
+
+// Count a change in the size of the heap, doing garbage collection work
+// first if it grows.
+static void countBytes(size_t oldSize, size_t newSize) {
+  if (sweeper_ != NULL) {
+    __atomic_add_fetch(&vm_.bytesAllocated, newSize - oldSize, __ATOMIC_RELAXED);
+    return;
+  }
   vm_.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
-    if (vm_.bytesAllocated > vm_.nextGC) {
-      collectGarbage();
+    vm_.gcStats.bytesAllocated += newSize - oldSize;
+    if (vm_.gcState != GC_IDLE) {
+      collectStep();
+    }
+    else if (vm_.bytesAllocated > vm_.nextGC) {
+      startCycle();
+      collectStep();
+    }
+    else if (vm_.bytesAllocated > vm_.nextYoungGC) {
+      collectYoung();
     }
   }
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  countBytes(oldSize, newSize);
 
   if (newSize == 0) {
     free(pointer);
@@ -32,18 +107,56 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-void markObject(Obj* object) {
-  if ((object == NULL) || (object->isMarked)) {
+// Objects themselves come from the slab allocator. Anything they own
+// still goes through reallocate().
+void* allocateObjectMemory(size_t size) {
+  countBytes(0, size);
+  return slabAllocate(&vm_.slabs, size);
+}
+
+// Sweeping threads leave the free lists of the size classes alone, and
+// slabReleaseEmpty() rebuilds them at the end of the cycle.
+void freeObjectMemory(void* pointer, size_t size) {
+  countBytes(size, 0);
+  if (sweeper_ != NULL) {
+    slabFreeInPage(pointer);
+  }
+  else {
+    slabFree(&vm_.slabs, pointer);
+  }
+}
+
+void rememberObject(Obj* object) {
+  if (object->isRemembered) {
     return;
   }
+  object->isRemembered = true;
 
-  if (config_.dbg_gc) {
-    print("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    print("\n");
+  if (vm_.rememberedCapacity < vm_.rememberedCount + 1) {
+    vm_.rememberedCapacity = GROW_CAPACITY(vm_.rememberedCapacity);
+    vm_.remembered = (Obj**)realloc(vm_.remembered, sizeof(Obj*) * vm_.rememberedCapacity);
+
+    if (vm_.remembered == NULL) {
+      exit(1);
+    }
   }
 
-  object->isMarked = true;
+  vm_.remembered[vm_.rememberedCount++] = object;
+}
+
+// Fibers and functions are modified without write barriers (their stacks
+// and inline caches), so once old they stay in the remembered set.
+static bool alwaysRemembered(Obj* object) {
+  return (object->type == OBJ_FIBER) || (object->type == OBJ_FUNCTION);
+}
+
+// Minor collections neither mark nor free old objects.
+bool isMarkedObject(Obj* object) {
+  return slabIsMarked(object) || (vm_.collectingYoung && object->isOld);
+}
+
+static void grayObject(Obj* object) {
+  slabMark(object);
 
   if (vm_.grayCapacity < vm_.grayCount + 1) {
     vm_.grayCapacity = GROW_CAPACITY(vm_.grayCapacity);
@@ -57,6 +170,65 @@ void markObject(Obj* object) {
   vm_.grayStack[vm_.grayCount++] = object;
 }
 
+static void pushGray(GrayStack* stack, Obj* object) {
+  if (stack->capacity < stack->count + 1) {
+    stack->capacity = GROW_CAPACITY(stack->capacity);
+    stack->objects = (Obj**)realloc(stack->objects, sizeof(Obj*) * stack->capacity);
+
+    if (stack->objects == NULL) {
+      exit(1);
+    }
+  }
+
+  stack->objects[stack->count++] = object;
+}
+
+void markObject(Obj* object) {
+  if (worker_ != NULL) {
+    // Marking in parallel: the first thread to set the bit owns the object.
+    if ((object != NULL) && slabMarkAtomic(object)) {
+      pushGray(&worker_->local, object);
+    }
+    return;
+  }
+
+  if ((object == NULL) || isMarkedObject(object)) {
+    return;
+  }
+
+  if (config_.dbg_gc) {
+    print("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    print("\n");
+  }
+
+  grayObject(object);
+}
+
+void writeBarrierSlow(Obj* owner, Value value) {
+  if (!IS_OBJ(value)) {
+    return;
+  }
+  Obj* object = AS_OBJ(value);
+  if ((vm_.gcState == GC_MARKING) && slabIsMarked(owner)) {
+    markObject(object);
+  }
+  if (owner->isOld && !object->isOld) {
+    rememberObject(owner);
+  }
+}
+
+// Barrier for stores of many values at once: the owner is remembered if
+// old, and traced again if marking has already reached it.
+void writeBarrierAll(Obj* owner) {
+  if (owner->isOld) {
+    rememberObject(owner);
+  }
+  if ((vm_.gcState == GC_MARKING) && slabIsMarked(owner)) {
+    grayObject(owner);
+  }
+}
+
 void markValue(Value value) {
   if (IS_OBJ(value)) {
     markObject(AS_OBJ(value));
@@ -69,6 +241,16 @@ void markArray(ValueArray* array) {
   }
 }
 
+// Keep the classes and shapes in inline caches alive so that a cache
+// entry cannot match a new object allocated at the same address.
+static void markCaches(Chunk* chunk) {
+  for (int i = 0; i < chunk->cacheCapacity; i++) {
+    for (int j = 0; j < CACHE_WAYS; j++) {
+      markObject(chunk->caches[i].entries[j].key);
+    }
+  }
+}
+
 static void markFiber(ObjFiber* fiber) {
   if (fiber == NULL) {
     return;
@@ -84,6 +266,9 @@ static void markFiber(ObjFiber* fiber) {
   for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
     markObject((Obj*)upvalue);
   }
+
+  markObject((Obj*)fiber->caller);
+  markObject((Obj*)fiber->next);
 }
 
 static void blackenObject(Obj* object) {
@@ -126,13 +311,22 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(&function->chunk.constants);
+      markCaches(&function->chunk);
       break;
     }
 
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
-      markTable(&instance->fields);
+      markInstanceFields(instance);
+      break;
+    }
+
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      markTable(&shape->transitions);
       break;
     }
 
@@ -149,11 +343,18 @@ static void blackenObject(Obj* object) {
 
     case OBJ_TABLE: {
       ObjTable* table = (ObjTable*)object;
-      markTable(&table->values);
+      markMap(&table->values);
+      break;
+    }
+
+    case OBJ_ITERATOR: {
+      markObject(((ObjIterator*)object)->source);
       break;
     }
 
+    case OBJ_BUFFER:
     case OBJ_NATIVE:
+    case OBJ_RANGE:
     case OBJ_STRING:
       break;
   }
@@ -166,73 +367,123 @@ void freeObject(Obj* object) {
 
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
-      FREE(ObjBoundMethod, object);
+      FREE_OBJ(ObjBoundMethod, object);
       break;
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       freeTable(&klass->methods);
-      FREE(ObjClass, object);
+      FREE_OBJ(ObjClass, object);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE_OBJ(ObjClosure, object);
       break;
     }
     case OBJ_FIBER: {
-      // FIXME: memory leak?
-      FREE(ObjFiber, object);
+      ObjFiber* fiber = (ObjFiber*)object;
+      FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+      FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+      FREE_OBJ(ObjFiber, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      FREE_OBJ(ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      freeInstanceFields(instance);
+      FREE_OBJ(ObjInstance, object);
       break;
     }
     case OBJ_NATIVE: {
-      FREE(ObjNative, object);
+      FREE_OBJ(ObjNative, object);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(&shape->transitions);
+      FREE_OBJ(ObjShape, object);
       break;
     }
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      FREE_OBJ(ObjString, object);
+      break;
+    }
+    case OBJ_BUFFER: {
+      ObjBuffer* buffer = (ObjBuffer*)object;
+      FREE_ARRAY(char, buffer->chars, buffer->capacity);
+      FREE_OBJ(ObjBuffer, object);
       break;
     }
     case OBJ_LIST: {
       ObjList* list = (ObjList*)object;
-      freeValueArray(&list->values);
-      FREE(ObjList, object);
+      freeListItems(list);
+      FREE_OBJ(ObjList, object);
       break;
     }
     case OBJ_TABLE: {
       ObjTable* table = (ObjTable*)object;
-      freeTable(&table->values);
-      FREE(ObjTable, object);
+      freeMap(&table->values);
+      FREE_OBJ(ObjTable, object);
       break;
     }
+    case OBJ_ITERATOR:
+      FREE_OBJ(ObjIterator, object);
+      break;
+    case OBJ_RANGE:
+      FREE_OBJ(ObjRange, object);
+      break;
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE_OBJ(ObjUpvalue, object);
       break;
   }
 }
 
 static void markRoots() {
-  markFiber(vm_.current);
+  markObject((Obj*)vm_.current);
+  markObject((Obj*)vm_.root);
+  markObject((Obj*)vm_.readyHead);
+  markObject((Obj*)vm_.emptyShape);
+  markObject((Obj*)vm_.listGetAt);
+  markObject((Obj*)vm_.listSetAt);
+  markObject((Obj*)vm_.tableGetAt);
+  markObject((Obj*)vm_.tableSetAt);
+  markObject((Obj*)vm_.listIter);
+  markObject((Obj*)vm_.tableIter);
+  markObject((Obj*)vm_.rangeIter);
+  markObject((Obj*)vm_.iteratorIter);
   markTable(&vm_.globals);
   markCompilerRoots();
   markConstants();
 }
 
+// Interned strings are weak references, dropped from the table as they
+// are freed.
+static void freeUnreached(Obj* object) {
+  if ((object->type == OBJ_STRING) && ((ObjString*)object)->isInterned) {
+    if (sweeper_ != NULL) {
+      pushGray(&sweeper_->strings, object);
+      return;
+    }
+    tableDelete(&vm_.strings, (ObjString*)object);
+  }
+  if (sweeper_ != NULL) {
+    freeObject(object);
+    return;
+  }
+  size_t before = vm_.bytesAllocated;
+  freeObject(object);
+  vm_.gcStats.bytesFreed += before - vm_.bytesAllocated;
+}
+
 static void traceReferences() {
   while (vm_.grayCount > 0) {
     Obj* object = vm_.grayStack[--vm_.grayCount];
@@ -240,59 +491,584 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm_.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+// Empty the remembered set, keeping the objects that are always in it
+// as long as they survive the collection.
+static void clearRemembered() {
+  int count = 0;
+  for (int i = 0; i < vm_.rememberedCount; i++) {
+    Obj* object = vm_.remembered[i];
+    if (alwaysRemembered(object) && isMarkedObject(object)) {
+      vm_.remembered[count++] = object;
     }
     else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      }
-      else {
-        vm_.objects = object;
-      }
+      object->isRemembered = false;
+    }
+  }
+  vm_.rememberedCount = count;
+}
+
+// Free an unreached young object or promote it to the old generation.
+static void sweepYoungObject(void* slot) {
+  Obj* object = (Obj*)slot;
+  if (object->isOld) {
+    return;
+  }
+  if (slabIsMarked(object)) {
+    object->isOld = true;
+    if (alwaysRemembered(object)) {
+      rememberObject(object);
+    }
+  }
+  else {
+    freeUnreached(object);
+  }
+}
+
+// Young objects are only found on the pages allocated from since the
+// previous collection.
+static void sweepYoung() {
+  for (SlabPage* page = vm_.slabs.newPages; page != NULL; page = page->nextNew) {
+    slabEachInPage(page, sweepYoungObject);
+    slabClearMarks(page);
+  }
+  slabClearNew(&vm_.slabs);
+}
+
+double nowMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static void recordPause(double micros) {
+  int bucket = 0;
+  while ((bucket < GC_PAUSE_BUCKETS - 1) && ((1 << bucket) <= micros)) {
+    bucket++;
+  }
+  vm_.pauses.counts[bucket]++;
+  vm_.pauses.count++;
+  if (micros > vm_.pauses.max) {
+    vm_.pauses.max = micros;
+  }
+
+  vm_.gcStats.pauseCount++;
+  vm_.gcStats.totalPauseMicros += micros;
+  if (micros > vm_.gcStats.maxPauseMicros) {
+    vm_.gcStats.maxPauseMicros = micros;
+  }
+}
+
+// Print and reset the histogram of the pauses since the previous major
+// collection ended, minor collections included.
+static void reportPauses() {
+  int p99 = 0;
+  int seen = 0;
+  while (p99 < GC_PAUSE_BUCKETS - 1) {
+    seen += vm_.pauses.counts[p99];
+    if (100 * seen >= 99 * vm_.pauses.count) {
+      break;
+    }
+    p99++;
+  }
 
-      freeObject(unreached);
+  print("-- gc %d pauses: %d, max %.1f us, p99 under %d us\n",
+	vm_.gcCycles, vm_.pauses.count, vm_.pauses.max, 1 << p99);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (vm_.pauses.counts[i] > 0) {
+      print("   %8d to %8d us: %d\n",
+	    (i == 0) ? 0 : 1 << (i - 1), 1 << i, vm_.pauses.counts[i]);
     }
   }
+  memset(&vm_.pauses, 0, sizeof(PauseHistogram));
 }
 
-int collectGarbage() {
+// Minor collection: trace young objects from the roots and the remembered
+// set, then promote the survivors.
+static int minorCollection() {
   size_t before = vm_.bytesAllocated;
   if (config_.dbg_gc) {
-    print("-- gc begin\n");
+    print("-- minor gc begin\n");
   }
 
+  vm_.collectingYoung = true;
+  vm_.gcStats.minorCollections++;
   markRoots();
+  for (int i = 0; i < vm_.rememberedCount; i++) {
+    blackenObject(vm_.remembered[i]);
+  }
   traceReferences();
-  tableRemoveWhite(&vm_.strings);
-  sweep();
+  clearRemembered();
+  sweepYoung();
+  slabReleaseEmpty(&vm_.slabs);
+  vm_.collectingYoung = false;
 
-  vm_.nextGC = vm_.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm_.nextYoungGC = vm_.bytesAllocated + GC_NURSERY_BYTES;
 
   int collected = before - vm_.bytesAllocated;
   if (config_.dbg_gc) {
-    print("-- gc end\n");
+    print("-- minor gc end\n");
     print("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-	  collected, before, vm_.bytesAllocated, vm_.nextGC);
+	  collected, before, vm_.bytesAllocated, vm_.nextYoungGC);
   }
   return collected;
 }
 
-void freeObjects() {
-  Obj* object = vm_.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+// Major collections are incremental: marking and sweeping are done a
+// slice at a time on allocation, and minor collections wait until the
+// cycle ends.
+static void startCycle() {
+  if (config_.dbg_gc) {
+    print("-- gc begin\n");
+  }
+  vm_.gcState = GC_MARKING;
+  vm_.markMicros = 0;
+  markRoots();
+}
+
+// Blacken an object during a major collection. Young objects are promoted
+// as soon as they are reached, so that stores into them go through the
+// generational barrier while they wait to be swept.
+static void blackenMajor(Obj* object) {
+  if (!object->isOld) {
+    object->isOld = true;
+    if (alwaysRemembered(object)) {
+      pthread_mutex_lock(&rememberLock_);
+      rememberObject(object);
+      pthread_mutex_unlock(&rememberLock_);
+    }
+  }
+  blackenObject(object);
+}
+
+// Move up to 'count' gray objects from the top of one stack to another.
+static void moveGray(GrayStack* from, GrayStack* to, int count) {
+  for (int i = 0; i < count; i++) {
+    pushGray(to, from->objects[--from->count]);
+  }
+}
+
+static void shareWork(MarkWorker* self, int count) {
+  pthread_mutex_lock(&self->lock);
+  moveGray(&self->local, &self->deque, count);
+  __atomic_store_n(&self->dequeCount, self->deque.count, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&self->lock);
+}
+
+// Take everything from the thread's own deque, or else steal half of the
+// first other deque that has work.
+static bool takeWork(MarkWorker* self) {
+  for (int i = 0; i < workerCount_; i++) {
+    MarkWorker* victim = &workers_[(self - workers_ + i) % workerCount_];
+    if (__atomic_load_n(&victim->dequeCount, __ATOMIC_RELAXED) == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&victim->lock);
+    int count = (victim == self) ? victim->deque.count : (victim->deque.count + 1) / 2;
+    moveGray(&victim->deque, &self->local, count);
+    __atomic_store_n(&victim->dequeCount, victim->deque.count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
+    if (count > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Wait until some deque has work, returning false once every thread is
+// idle. A thread only goes idle with an empty deque, and only its owner
+// adds to a deque, so there is no work left at that point.
+static bool waitForWork() {
+  __atomic_add_fetch(&idleWorkers_, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    if (__atomic_load_n(&idleWorkers_, __ATOMIC_SEQ_CST) == workerCount_) {
+      return false;
+    }
+    for (int i = 0; i < workerCount_; i++) {
+      if (__atomic_load_n(&workers_[i].dequeCount, __ATOMIC_RELAXED) > 0) {
+        __atomic_sub_fetch(&idleWorkers_, 1, __ATOMIC_SEQ_CST);
+        return true;
+      }
+    }
+    sched_yield();
+  }
+}
+
+static void drainWorker(MarkWorker* self) {
+  worker_ = self;
+  do {
+    while (self->local.count > 0) {
+      blackenMajor(self->local.objects[--self->local.count]);
+      if ((self->local.count > GC_SHARE_THRESHOLD) &&
+          (__atomic_load_n(&self->dequeCount, __ATOMIC_RELAXED) == 0)) {
+        shareWork(self, self->local.count / 2);
+      }
+    }
+  } while (takeWork(self) || waitForWork());
+  worker_ = NULL;
+}
+
+static void* markThread(void* arg) {
+  drainWorker((MarkWorker*)arg);
+  return NULL;
+}
+
+// Start threads 1 to count - 1 on the elements of 'args', of 'size' bytes
+// each, with element 0 left for the calling thread. Returns how many
+// threads are running, the calling one included, which is fewer than
+// 'count' if the system runs out.
+static int startThreads(pthread_t* threads, int count, void* (*run)(void*), void* args, size_t size) {
+  int started = 1;
+  for (; started < count; started++) {
+    if (pthread_create(&threads[started], NULL, run, (char*)args + started * size) != 0) {
+      break;
+    }
+  }
+  return started;
+}
+
+// Drain the gray stack with config_.gc_threads threads, the calling one
+// included. Marks the same objects as the serial loop.
+static void traceParallel() {
+  workerCount_ = config_.gc_threads;
+  workers_ = (MarkWorker*)calloc(workerCount_, sizeof(MarkWorker));
+  if (workers_ == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < workerCount_; i++) {
+    pthread_mutex_init(&workers_[i].lock, NULL);
+  }
+  for (int i = 0; i < vm_.grayCount; i++) {
+    pushGray(&workers_[i % workerCount_].local, vm_.grayStack[i]);
+  }
+  vm_.grayCount = 0;
+  idleWorkers_ = 0;
+
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * workerCount_);
+  if (threads == NULL) {
+    exit(1);
   }
+  int started = startThreads(threads, workerCount_, markThread, workers_, sizeof(MarkWorker));
+  if (started < workerCount_) {
+    // Workers without a thread count as idle, with their gray objects
+    // left for the others to steal.
+    __atomic_add_fetch(&idleWorkers_, workerCount_ - started, __ATOMIC_SEQ_CST);
+    for (int i = started; i < workerCount_; i++) {
+      shareWork(&workers_[i], workers_[i].local.count);
+    }
+  }
+  drainWorker(&workers_[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < workerCount_; i++) {
+    free(workers_[i].local.objects);
+    free(workers_[i].deque.objects);
+    pthread_mutex_destroy(&workers_[i].lock);
+  }
+  free(workers_);
+  free(threads);
+  workers_ = NULL;
+  workerCount_ = 0;
+}
+
+// Blacken every gray object, in parallel if more than one GC thread is
+// configured. The -g trace is only available serially.
+static void traceMajor() {
+  if ((config_.gc_threads > 1) && !config_.dbg_gc) {
+    traceParallel();
+    return;
+  }
+  while (vm_.grayCount > 0) {
+    blackenMajor(vm_.grayStack[--vm_.grayCount]);
+  }
+}
+
+// The atomic end of marking. The roots, and the fibers and functions in
+// the remembered set, change without write barriers, so they are scanned
+// again before the white objects are known to be garbage.
+static void finishMarking() {
+  markRoots();
+  for (int i = 0; i < vm_.rememberedCount; i++) {
+    Obj* object = vm_.remembered[i];
+    if (alwaysRemembered(object) && slabIsMarked(object)) {
+      blackenObject(object);
+    }
+  }
+  traceMajor();
+  clearRemembered();
+
+  // Every object so far is either marked and old, or garbage. The pages
+  // are swept before they are allocated from again, so objects allocated
+  // from now on are white and stay out of the sweep.
+  slabClearNew(&vm_.slabs);
+  for (int i = 0; i <= SLAB_CLASSES; i++) {
+    SlabClass* sizeClass = (i < SLAB_CLASSES) ? &vm_.slabs.classes[i] : &vm_.slabs.large;
+    for (SlabPage* page = sizeClass->pages; page != NULL; page = page->next) {
+      page->needsSweep = (page->liveCount > 0);
+    }
+  }
+  vm_.sweepClass = 0;
+  vm_.sweepPage = vm_.slabs.classes[0].pages;
+  vm_.sweepMicros = 0;
+  memset(sweptLive_, 0, sizeof(sweptLive_));
+  vm_.gcState = GC_SWEEPING;
+}
+
+static void sweepObject(void* slot) {
+  Obj* object = (Obj*)slot;
+  if (slabIsMarked(slot)) {
+    size_t* live = (sweeper_ != NULL) ? sweeper_->liveBytes : sweptLive_;
+    live[object->type] += slabPageOf(slot)->slotSize;
+  }
+  else {
+    freeUnreached(object);
+  }
+}
+
+// Sweep a page if it still holds objects from before the end of marking.
+// Also called by the allocator before it reuses such a page.
+void sweepPage(SlabPage* page) {
+  if (page->needsSweep) {
+    page->needsSweep = false;
+    slabEachInPage(page, sweepObject);
+    slabClearMarks(page);
+  }
+}
+
+// The next page for the sweep, in size class order with large objects
+// last, or NULL once every page has been visited. Pages added in the
+// meantime are put in front of the lists, and need no sweeping.
+static SlabPage* nextSweepPage() {
+  while (vm_.sweepPage == NULL) {
+    if (vm_.sweepClass == SLAB_CLASSES) {
+      return NULL;
+    }
+    vm_.sweepClass++;
+    vm_.sweepPage = (vm_.sweepClass < SLAB_CLASSES) ?
+      vm_.slabs.classes[vm_.sweepClass].pages : vm_.slabs.large.pages;
+  }
+  SlabPage* page = vm_.sweepPage;
+  vm_.sweepPage = page->next;
+  return page;
+}
+
+static void* sweepThread(void* arg) {
+  sweeper_ = (SweepWorker*)arg;
+  for (;;) {
+    int index = __atomic_fetch_add(&nextSweepPage_, 1, __ATOMIC_RELAXED);
+    if (index >= sweepPageCount_) {
+      break;
+    }
+    sweepPage(sweepPages_[index]);
+  }
+  sweeper_ = NULL;
+  return NULL;
+}
+
+// Sweep the rest of the pages with config_.gc_threads threads, the calling
+// one included.
+static void sweepParallel() {
+  int capacity = vm_.slabs.pageCount;
+  sweepPages_ = (SlabPage**)malloc(sizeof(SlabPage*) * (capacity + 1));
+  if (sweepPages_ == NULL) {
+    exit(1);
+  }
+  sweepPageCount_ = 0;
+  nextSweepPage_ = 0;
+  for (SlabPage* page = nextSweepPage(); page != NULL; page = nextSweepPage()) {
+    if (page->needsSweep) {
+      sweepPages_[sweepPageCount_++] = page;
+    }
+  }
+
+  int count = config_.gc_threads;
+  SweepWorker* sweepers = (SweepWorker*)calloc(count, sizeof(SweepWorker));
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+  if ((sweepers == NULL) || (threads == NULL)) {
+    exit(1);
+  }
+  size_t before = vm_.bytesAllocated;
+  int started = startThreads(threads, count, sweepThread, sweepers, sizeof(SweepWorker));
+  sweepThread(&sweepers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  vm_.gcStats.bytesFreed += before - vm_.bytesAllocated;
+
+  for (int i = 0; i < count; i++) {
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+      sweptLive_[type] += sweepers[i].liveBytes[type];
+    }
+    GrayStack* strings = &sweepers[i].strings;
+    for (int j = 0; j < strings->count; j++) {
+      freeUnreached(strings->objects[j]);
+    }
+    free(strings->objects);
+  }
+  free(sweepers);
+  free(threads);
+  free(sweepPages_);
+  sweepPages_ = NULL;
+}
+
+// The heap size that starts the next major collection, given the bytes
+// still allocated after this one.
+static size_t nextHeapTarget(size_t live) {
+  double target = live * config_.gc_growth_factor;
+  if ((config_.gc_soft_heap > 0) && (target > config_.gc_soft_heap)) {
+    double slow = live * GC_SOFT_GROWTH_FACTOR;
+    target = (slow < target) ? slow : target;
+    target = (target > config_.gc_soft_heap) ? target : config_.gc_soft_heap;
+  }
+  if (target < config_.gc_min_heap) {
+    target = config_.gc_min_heap;
+  }
+  if ((config_.gc_max_heap > 0) && (target > config_.gc_max_heap)) {
+    target = config_.gc_max_heap;
+  }
+  return (size_t)target;
+}
+
+static void finishCycle() {
+  slabReleaseEmpty(&vm_.slabs);
+  memcpy(vm_.gcStats.liveBytes, sweptLive_, sizeof(sweptLive_));
+  // With -k, compact once packing the objects would free that percentage
+  // of the pages, and enough of them to be worth it.
+  if (config_.gc_compact_percent > 0) {
+    int spare = slabSparePages(&vm_.slabs);
+    if ((spare >= GC_COMPACT_MIN_PAGES) &&
+        (100 * spare > config_.gc_compact_percent * vm_.slabs.pageCount)) {
+      vm_.compactPending = true;
+    }
+  }
+  vm_.gcState = GC_IDLE;
+  vm_.gcCycles++;
+  vm_.nextGC = nextHeapTarget(vm_.bytesAllocated);
+  vm_.nextYoungGC = vm_.bytesAllocated + GC_NURSERY_BYTES;
+
+  if (config_.dbg_gc) {
+    print("-- gc end\n");
+    print("   heap at %zu next at %zu\n", vm_.bytesAllocated, vm_.nextGC);
+  }
+}
+
+// Whether a step that began at 'start' may go on after 'work' units, which
+// are objects blackened or swept.
+static bool withinBudget(int work, double start) {
+  if (config_.gc_step_micros > 0) {
+    return ((work % GC_CLOCK_INTERVAL) != 0) ||
+      (nowMicros() - start < config_.gc_step_micros);
+  }
+  return work < config_.gc_step_objects;
+}
+
+// The same for the sweep, which frees a page of objects at a time, so the
+// clock is read before each page.
+static bool sweepWithinBudget(int work, double start) {
+  if (config_.gc_step_micros > 0) {
+    return nowMicros() - start < config_.gc_step_micros;
+  }
+  return work < config_.gc_step_objects;
+}
+
+// Do a slice of the major collection in progress, limited by the step
+// budget if 'bounded' is set. Returns true if the slice ended the cycle.
+static bool collectSlice(bool bounded, double start) {
+  int work = 0;
+  if (vm_.gcState == GC_MARKING) {
+    double markStart = nowMicros();
+    // With several GC threads the marking is done in one parallel pause.
+    if (!bounded || (config_.gc_threads > 1)) {
+      traceMajor();
+    }
+    while ((vm_.grayCount > 0) && withinBudget(work, start)) {
+      blackenMajor(vm_.grayStack[--vm_.grayCount]);
+      work++;
+    }
+    if (vm_.grayCount == 0) {
+      finishMarking();
+    }
+    vm_.markMicros += nowMicros() - markStart;
+    return false;
+  }
+
+  double sweepStart = nowMicros();
+  bool finished = false;
+  if ((config_.gc_threads > 1) && !config_.dbg_gc) {
+    // Like marking, the sweep is done in one parallel pause.
+    sweepParallel();
+    finished = true;
+  }
+  while (!finished && (!bounded || sweepWithinBudget(work, start))) {
+    SlabPage* page = nextSweepPage();
+    if (page == NULL) {
+      finished = true;
+    }
+    else if (page->needsSweep) {
+      work += page->liveCount;
+      sweepPage(page);
+    }
+  }
+  vm_.sweepMicros += nowMicros() - sweepStart;
+  if (finished) {
+    finishCycle();
+  }
+  return finished;
+}
+
+static void collectStep() {
+  double start = nowMicros();
+  bool finished = collectSlice(true, start);
+  recordPause(nowMicros() - start);
+  if (finished && config_.dbg_pauses) {
+    reportPauses();
+  }
+}
+
+// Finish the major collection in progress, if any, in one pause.
+static void finishCollection() {
+  while (vm_.gcState != GC_IDLE) {
+    collectSlice(false, 0);
+  }
+}
+
+int collectYoung() {
+  double start = nowMicros();
+  size_t before = vm_.bytesAllocated;
+  if (vm_.gcState != GC_IDLE) {
+    // The major collection promotes every survivor anyway.
+    finishCollection();
+  }
+  else {
+    minorCollection();
+  }
+  recordPause(nowMicros() - start);
+  return before - vm_.bytesAllocated;
+}
+
+// Full, non-incremental collection of both generations.
+int collectGarbage() {
+  double start = nowMicros();
+  size_t before = vm_.bytesAllocated;
+  finishCollection();
+  startCycle();
+  finishCollection();
+  recordPause(nowMicros() - start);
+  if (config_.dbg_pauses) {
+    reportPauses();
+  }
+  return before - vm_.bytesAllocated;
+}
+
+static void freeSlot(void* slot) {
+  freeObject((Obj*)slot);
+}
+
+void freeObjects() {
+  slabEach(&vm_.slabs, freeSlot);
 
   free(vm_.grayStack);
+  free(vm_.remembered);
+  freeSlabs(&vm_.slabs);
 }
@@ -3,11 +3,14 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+#define FREE_OBJ(type, pointer) freeObjectMemory(pointer, sizeof(type))
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
@@ -17,11 +20,46 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Bytes allocated between minor collections of the young generation.
+#define GC_NURSERY_BYTES (256 * 1024)
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(size_t size);
+void freeObjectMemory(void* pointer, size_t size);
+void rememberObject(Obj* object);
+void writeBarrierSlow(Obj* owner, Value value);
+void writeBarrierAll(Obj* owner);
+
+// Write barrier, used after storing a value into an object.
+// Minor collections only trace old objects in the remembered set, so an
+// old object that may refer to a young one must be added to it. While a
+// major collection is marking, the stored value is also shaded so that a
+// black object never points to a white one. Stores into an object that no
+// collection can have reached since it was allocated need no barrier.
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (owner->isOld || (vm_.gcState == GC_MARKING)) {
+    writeBarrierSlow(owner, value);
+  }
+}
+
+static inline void writeBarrierEntry(Obj* owner, ObjString* key, Value value) {
+  writeBarrier(owner, OBJ_VAL(key));
+  writeBarrier(owner, value);
+}
+
+static inline void writeBarrierMapEntry(Obj* owner, Value key, Value value) {
+  writeBarrier(owner, key);
+  writeBarrier(owner, value);
+}
+
+bool isMarkedObject(Obj* object);
 void markObject(Obj* object);
 void markValue(Value value);
 void markArray(ValueArray* array);
+int collectYoung();
 int collectGarbage();
+void sweepPage(SlabPage* page);
+double nowMicros();
 void freeObject(Obj* object);
 void freeObjects();
 
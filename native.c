@@ -1,10 +1,14 @@
+#include <math.h>
 #include <time.h>
 
 #include "common.h"
+#include "compact.h"
 #include "constants.h"
 #include "debug.h"
+#include "list.h"
 #include "memory.h"
 #include "native.h"
+#include "shape.h"
 #include "string.h"
 #include "vm.h"
 
@@ -16,6 +20,15 @@ static void defineNative(const char* name, NativeFn function) {
   pop();
 }
 
+// An Iterator instance through a list, a range or a table.
+static Value iterate(Obj* source, IteratorKind kind) {
+  ObjIterator* iterator = newCoreIterator(source, kind);
+  push(OBJ_VAL(iterator));
+  ObjInstance* instance = newCoreInstance(strIteratorClass_, (Obj*)iterator);
+  pop();
+  return (instance == NULL) ? NIL_VAL : OBJ_VAL(instance);
+}
+
 // ----------------------------------------------------------------------
 
 static Value _concat_(int argc, Value* argv) {
@@ -32,11 +45,77 @@ static Value _concat_(int argc, Value* argv) {
   return OBJ_VAL(result);
 }
 
+static Value _cache_stats_(int argc, Value* argv) {
+  ObjTable* table = newCoreTable();
+  push(OBJ_VAL(table));
+  mapSet(&table->values, strHits_, NUMBER_VAL(vm_.cacheHits));
+  writeBarrier((Obj*)table, strHits_);
+  mapSet(&table->values, strMisses_, NUMBER_VAL(vm_.cacheMisses));
+  writeBarrier((Obj*)table, strMisses_);
+  ObjInstance* instance = newCoreInstance(strTableClass_, (Obj*)table);
+  pop();
+  return (instance == NULL) ? NIL_VAL : OBJ_VAL(instance);
+}
+
+// Store a number into the table of a Table instance being built.
+static void setStat(ObjTable* table, Value key, double value) {
+  mapSet(&table->values, mapKey(key), NUMBER_VAL(value));
+  writeBarrier((Obj*)table, key);
+}
+
+// Bytes taken by the objects of each type that survived the latest major
+// collection, not counting the arrays they own.
+static ObjInstance* liveStats() {
+  ObjTable* table = newCoreTable();
+  push(OBJ_VAL(table));
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    const char* name = objectTypeName(type);
+    Value key = OBJ_VAL(copyString(name, (int)strlen(name)));
+    push(key);
+    setStat(table, key, vm_.gcStats.liveBytes[type]);
+    pop();
+  }
+  ObjInstance* instance = newCoreInstance(strTableClass_, (Obj*)table);
+  pop();
+  return instance;
+}
+
+static Value _gc_stats_(int argc, Value* argv) {
+  GcStats* stats = &vm_.gcStats;
+  double seconds = (nowMicros() - stats->startMicros) / 1e6;
+
+  ObjTable* table = newCoreTable();
+  push(OBJ_VAL(table));
+  setStat(table, strCollections_, vm_.gcCycles);
+  setStat(table, strMinorCollections_, stats->minorCollections);
+  setStat(table, strPauses_, stats->pauseCount);
+  setStat(table, strTotalPause_, stats->totalPauseMicros);
+  setStat(table, strMaxPause_, stats->maxPauseMicros);
+  setStat(table, strBytesFreed_, stats->bytesFreed);
+  setStat(table, strHeapBytes_, vm_.bytesAllocated);
+  setStat(table, strAllocationRate_, (seconds > 0) ? stats->bytesAllocated / seconds : 0);
+
+  ObjInstance* live = liveStats();
+  if (live != NULL) {
+    push(OBJ_VAL(live));
+    mapSet(&table->values, strLive_, OBJ_VAL(live));
+    writeBarrierMapEntry((Obj*)table, strLive_, OBJ_VAL(live));
+    pop();
+  }
+  ObjInstance* instance = newCoreInstance(strTableClass_, (Obj*)table);
+  pop();
+  return (instance == NULL) ? NIL_VAL : OBJ_VAL(instance);
+}
+
 static Value _clock_(int argc, Value* argv) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// gc(true) also compacts the heap.
 static Value _gc_(int argc, Value* argv) {
+  if ((argc > 0) && IS_BOOL(argv[0]) && AS_BOOL(argv[0])) {
+    return NUMBER_VAL(compactHeap());
+  }
   return NUMBER_VAL(collectGarbage());
 }
 
@@ -55,14 +134,15 @@ static Value _has_(int argc, Value* argv) {
 
   if (IS_CLASS(argv[0])) {
     ObjClass* klass = AS_CLASS(argv[0]);
-    ObjString* name = AS_STRING(argv[1]);
-    has = tableGet(&klass->methods, name, &temp);
+    ObjString* name = findString(AS_STRING(argv[1]));
+    has = (name != NULL) && tableGet(&klass->methods, name, &temp);
   }
   else if (IS_INSTANCE(argv[0])) {
     ObjInstance* instance = AS_INSTANCE(argv[0]);
-    ObjString* name = AS_STRING(argv[1]);
-    has = tableGet(&instance->fields, name, &temp) ||
-          tableGet(&instance->klass->methods, name, &temp);
+    ObjString* name = findString(AS_STRING(argv[1]));
+    has = (name != NULL) &&
+          (instanceGetField(instance, name, &temp) ||
+           tableGet(&instance->klass->methods, name, &temp));
   }
   return BOOL_VAL(has);
 }
@@ -115,9 +195,18 @@ static Value _type_(int argc, Value* argv) {
   else if (IS_LIST(value)) {
     return strList_;
   }
+  else if (IS_BUFFER(value)) {
+    return strBuffer_;
+  }
   else if (IS_TABLE(value)) {
     return strTable_;
   }
+  else if (IS_ITERATOR(value)) {
+    return strIterator_;
+  }
+  else if (IS_RANGE(value)) {
+    return strRange_;
+  }
   else {
     return strUnknown_;
   }
@@ -125,8 +214,10 @@ static Value _type_(int argc, Value* argv) {
 
 void initCoreMisc() {
   defineNative("_concat_", _concat_);
+  defineNative("cacheStats", _cache_stats_);
   defineNative("clock", _clock_);
   defineNative("gc", _gc_);
+  defineNative("gcStats", _gc_stats_);
   defineNative("globals", _globals_);
   defineNative("has", _has_);
   defineNative("_str_", _str_);
@@ -153,7 +244,8 @@ static Value _list_add_(int argc, Value* argv) {
   // FIXME: check that the first is a list
   ObjList* list = (ObjList*)AS_OBJ(argv[0]);
   Value value = argv[1];
-  writeValueArray(&list->values, value);
+  listAppend(list, value);
+  writeBarrier((Obj*)list, value);
   return NUMBER_VAL(list->values.count - 1);
 }
 
@@ -163,21 +255,34 @@ static Value _list_del_(int argc, Value* argv) {
   ObjList* list = (ObjList*)AS_OBJ(argv[0]);
   int index = AS_NUMBER(argv[1]);
   if ((0 <= index) && (index < list->values.count)) {
-    for (int i=index; i<list->values.count-1; i++) {
-      list->values.values[i] = list->values.values[i+1];
-    }
-    list->values.count--;
-    list->values.values[list->values.count] = NIL_VAL;
+    listRemove(list, index);
   }
   return NIL_VAL;
 }
 
+// Reports a native error unless 'index' is the number of an item in
+// 'list', which is then put in 'at'.
+static bool checkListIndex(ObjList* list, Value index, int* at) {
+  if (!IS_NUMBER(index)) {
+    nativeError("List index must be a number.");
+    return false;
+  }
+  if (!(AS_NUMBER(index) >= 0) || (AS_NUMBER(index) >= list->values.count)) {
+    nativeError("List index out of range.");
+    return false;
+  }
+  *at = (int)AS_NUMBER(index);
+  return true;
+}
+
 static Value _list_get_(int argc, Value* argv) {
   // FIXME: check that there are two values
   // FIXME: check that the first is a list
-  // FIXME: check that the second is a legal index
   ObjList* list = (ObjList*)AS_OBJ(argv[0]);
-  int index = AS_NUMBER(argv[1]);
+  int index;
+  if (!checkListIndex(list, argv[1], &index)) {
+    return NIL_VAL;
+  }
   return list->values.values[index];
 }
 
@@ -188,36 +293,19 @@ static Value _list_insert_(int argc, Value* argv) {
   ObjList* list = (ObjList*)AS_OBJ(argv[0]);
   int index = AS_NUMBER(argv[1]);
   Value value = argv[2];
-
-  // Inserting into an empty list.
-  if (list->values.count == 0) {
-    if (index == 0) {
-      writeValueArray(&list->values, value);
-    }
+  if ((0 <= index) && (index <= list->values.count)) {
+    listInsert(list, index, value);
+    writeBarrier((Obj*)list, value);
   }
-
-  // Inserting at the end.
-  else if (index == list->values.count) {
-    writeValueArray(&list->values, value);
-  }
-
-  // Inserting in range.
-  else if ((0 <= index) && (index < list->values.count)) {
-    // Add a value to the end of the array to increase the size.
-    writeValueArray(&list->values, NIL_VAL);
-
-    // Copy values up.
-    for (int i=list->values.count-1; i>index; i--) {
-      list->values.values[i] = list->values.values[i-1];
-    }
-
-    // Insert.
-    list->values.values[index] = value;
-  }
-
   return NIL_VAL;
 }
 
+static Value _list_iter_(int argc, Value* argv) {
+  // FIXME: check that there is just one value
+  // FIXME: check that the value is a list
+  return iterate(AS_OBJ(argv[0]), ITERATE_LIST);
+}
+
 static Value _list_len_(int argc, Value* argv) {
   // FIXME: check that there is just one value
   // FIXME: check that the value is a list
@@ -234,11 +322,14 @@ static Value _list_new_(int argc, Value* argv) {
 static Value _list_set_(int argc, Value* argv) {
   // FIXME: check that there are three values
   // FIXME: check that the first is a list
-  // FIXME: check that the second is a legal index
   ObjList* list = (ObjList*)AS_OBJ(argv[0]);
-  int index = AS_NUMBER(argv[1]);
+  int index;
+  if (!checkListIndex(list, argv[1], &index)) {
+    return NIL_VAL;
+  }
   Value value = argv[2];
   list->values.values[index] = value;
+  writeBarrier((Obj*)list, value);
   return NIL_VAL;
 }
 
@@ -246,41 +337,408 @@ static Value _list_str_(int argc, Value* argv) {
   return valueToString(argv[0]);
 }
 
+// A List instance around a list, which must be reachable.
+static Value listInstance(ObjList* list) {
+  ObjInstance* instance = newCoreInstance(strListClass_, (Obj*)list);
+  return (instance == NULL) ? NIL_VAL : OBJ_VAL(instance);
+}
+
+static Value _list_extend_(int argc, Value* argv) {
+  // FIXME: check that there are two values
+  // FIXME: check that the first is a list
+  if (!IS_LIST(argv[1])) {
+    return nativeError("Can only extend a List with another List.");
+  }
+  ObjList* list = AS_LIST(argv[0]);
+  ObjList* other = AS_LIST(argv[1]);
+  int count = other->values.count;
+  for (int i = 0; i < count; i++) {
+    listAppend(list, other->values.values[i]);
+  }
+  writeBarrierAll((Obj*)list);
+  return NIL_VAL;
+}
+
+static Value _list_index_of_(int argc, Value* argv) {
+  // FIXME: check that there are two values
+  // FIXME: check that the first is a list
+  ObjList* list = AS_LIST(argv[0]);
+  for (int i = 0; i < list->values.count; i++) {
+    if (valuesEqual(list->values.values[i], argv[1])) {
+      return NUMBER_VAL(i);
+    }
+  }
+  return NUMBER_VAL(-1);
+}
+
+static Value _list_reverse_(int argc, Value* argv) {
+  // FIXME: check that there is just one value
+  // FIXME: check that the value is a list
+  reverseValueArray(&AS_LIST(argv[0])->values);
+  return NIL_VAL;
+}
+
+// An index for slicing, counted from the end if negative, and clamped to
+// the list. It must be a number, and not NaN.
+static int sliceIndex(ObjList* list, Value index) {
+  int count = list->values.count;
+  double at = AS_NUMBER(index);
+  if (at < 0) {
+    at += count;
+  }
+  return (at < 0) ? 0 : (at > count) ? count : (int)at;
+}
+
+// A new List of the items from start up to but not including end.
+static Value _list_slice_(int argc, Value* argv) {
+  // FIXME: check that there are three values
+  // FIXME: check that the first is a list
+  if (!IS_NUMBER(argv[1]) || isnan(AS_NUMBER(argv[1])) ||
+      !IS_NUMBER(argv[2]) || isnan(AS_NUMBER(argv[2]))) {
+    return nativeError("Slice start and end must be numbers.");
+  }
+  ObjList* slice = newCoreList();
+  push(OBJ_VAL(slice));
+  ObjList* list = AS_LIST(argv[0]);
+  int start = sliceIndex(list, argv[1]);
+  int end = sliceIndex(list, argv[2]);
+  for (int i = start; i < end; i++) {
+    listAppend(slice, list->values.values[i]);
+  }
+  writeBarrierAll((Obj*)slice);
+  Value result = listInstance(slice);
+  pop();
+  return result;
+}
+
+// Natives that call back into the VM find their arguments again by their
+// place in the stack after each call, since the call may move the stack
+// and compact the heap. Anything else they need to keep goes on the
+// stack above the arguments.
+
+static inline int stackIndex(Value* argv) {
+  return (int)(argv - vm_.current->stack);
+}
+
+static inline Value* stackAt(int index) {
+  return vm_.current->stack + index;
+}
+
+// Call a function with one or two arguments, leaving its result on top
+// of the stack. Returns false if the call failed.
+static bool callBack(Value function, int argCount, Value a, Value b) {
+  push(function);
+  push(a);
+  if (argCount > 1) {
+    push(b);
+  }
+  return callFromNative(argCount);
+}
+
+// list.map(function) is a new List of what the function returns for
+// each item.
+static Value _list_map_(int argc, Value* argv) {
+  // FIXME: check that there are two values
+  // FIXME: check that the first is a list
+  int base = stackIndex(argv);
+  push(OBJ_VAL(newCoreList()));
+  for (int i = 0; i < AS_LIST(stackAt(base)[0])->values.count; i++) {
+    Value* args = stackAt(base);
+    if (!callBack(args[1], 1, AS_LIST(args[0])->values.values[i], NIL_VAL)) {
+      return NIL_VAL;
+    }
+    ObjList* mapped = AS_LIST(stackAt(base)[2]);
+    listAppend(mapped, vm_.current->stackTop[-1]);
+    writeBarrier((Obj*)mapped, pop());
+  }
+  Value result = listInstance(AS_LIST(stackAt(base)[2]));
+  pop();
+  return result;
+}
+
+// list.filter(predicate) is a new List of the items for which the
+// predicate is true.
+static Value _list_filter_(int argc, Value* argv) {
+  // FIXME: check that there are two values
+  // FIXME: check that the first is a list
+  int base = stackIndex(argv);
+  push(OBJ_VAL(newCoreList()));
+  for (int i = 0; i < AS_LIST(stackAt(base)[0])->values.count; i++) {
+    // The item stays on the stack in case the predicate removes it from
+    // the list.
+    Value* args = stackAt(base);
+    Value item = AS_LIST(args[0])->values.values[i];
+    push(item);
+    if (!callBack(args[1], 1, item, NIL_VAL)) {
+      return NIL_VAL;
+    }
+    if (!isFalsey(pop())) {
+      ObjList* filtered = AS_LIST(stackAt(base)[2]);
+      listAppend(filtered, vm_.current->stackTop[-1]);
+      writeBarrier((Obj*)filtered, vm_.current->stackTop[-1]);
+    }
+    pop();
+  }
+  Value result = listInstance(AS_LIST(stackAt(base)[2]));
+  pop();
+  return result;
+}
+
+// list.reduce(function, initial) calls function(total, item) for each
+// item, the total starting as initial and becoming what the function
+// returns.
+static Value _list_reduce_(int argc, Value* argv) {
+  // FIXME: check that there are three values
+  // FIXME: check that the first is a list
+  int base = stackIndex(argv);
+  for (int i = 0; i < AS_LIST(stackAt(base)[0])->values.count; i++) {
+    Value* args = stackAt(base);
+    if (!callBack(args[1], 2, args[2], AS_LIST(args[0])->values.values[i])) {
+      return NIL_VAL;
+    }
+    stackAt(base)[2] = pop();
+  }
+  return stackAt(base)[2];
+}
+
+// Whether 'a' must come before 'b' in a sort. Without a function to
+// say, numbers and strings are sorted in ascending order. Returns false
+// if the comparison failed.
+static bool sortBefore(int base, Value a, Value b, bool* before) {
+  Value function = stackAt(base)[1];
+  if (!IS_NIL(function)) {
+    if (!callBack(function, 2, a, b)) {
+      return false;
+    }
+    *before = !isFalsey(pop());
+    return true;
+  }
+
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    *before = AS_NUMBER(a) < AS_NUMBER(b);
+    return true;
+  }
+  if (IS_STRING(a) && IS_STRING(b)) {
+    ObjString* x = AS_STRING(a);
+    ObjString* y = AS_STRING(b);
+    int order = memcmp(x->chars, y->chars, (x->length < y->length) ? x->length : y->length);
+    *before = (order < 0) || ((order == 0) && (x->length < y->length));
+    return true;
+  }
+  nativeError("Only numbers and strings can be sorted without a comparison function.");
+  return false;
+}
+
+// Sort short runs by binary insertion, each item going after any equal
+// ones.
+static bool insertionSort(int base, Value* items, int from, int to) {
+  for (int i = from + 1; i < to; i++) {
+    int low = from;
+    int high = i;
+    while (low < high) {
+      int middle = low + (high - low) / 2;
+      bool before;
+      if (!sortBefore(base, items[i], items[middle], &before)) {
+        return false;
+      }
+      if (before) {
+        high = middle;
+      }
+      else {
+        low = middle + 1;
+      }
+    }
+    Value item = items[i];
+    memmove(&items[low + 1], &items[low], (i - low) * sizeof(Value));
+    items[low] = item;
+  }
+  return true;
+}
+
+// Merge the sorted runs from..middle and middle..to of 'from' into 'to',
+// taking from the first run when items are equal. Runs already in order
+// are copied across whole.
+static bool mergeRuns(int base, Value* source, Value* target, int from, int middle, int to) {
+  bool before;
+  if (!sortBefore(base, source[middle], source[middle - 1], &before)) {
+    return false;
+  }
+  if (!before) {
+    memcpy(&target[from], &source[from], (to - from) * sizeof(Value));
+    return true;
+  }
+
+  int left = from;
+  int right = middle;
+  int out = from;
+  while ((left < middle) && (right < to)) {
+    if (!sortBefore(base, source[right], source[left], &before)) {
+      return false;
+    }
+    target[out++] = before ? source[right++] : source[left++];
+  }
+  memcpy(&target[out], &source[left], (middle - left) * sizeof(Value));
+  out += middle - left;
+  memcpy(&target[out], &source[right], (to - right) * sizeof(Value));
+  return true;
+}
+
+#define SORT_RUN 16
+
+// list.sort(before) sorts the list in place, stably, 'before' being nil
+// or a function of two items that is true when the first must come
+// before the second. It is a merge sort, bottom up from runs sorted by
+// insertion. The items are sorted in a copy of the list, merging back
+// and forth with a second copy, both kept on the stack where the
+// collector sees them. The arrays of the copies never grow, so they
+// stay put even if the heap is compacted while the function runs.
+static Value _list_sort_(int argc, Value* argv) {
+  // FIXME: check that there are two values
+  // FIXME: check that the first is a list
+  int base = stackIndex(argv);
+  int count = AS_LIST(argv[0])->values.count;
+  for (int copy = 0; copy < 2; copy++) {
+    ObjList* items = newCoreList();
+    push(OBJ_VAL(items));
+    ObjList* list = AS_LIST(stackAt(base)[0]);
+    for (int i = 0; i < count; i++) {
+      listAppend(items, list->values.values[i]);
+    }
+    writeBarrierAll((Obj*)items);
+  }
+
+  int sourceSlot = base + 2;
+  int targetSlot = base + 3;
+  Value* source = AS_LIST(*stackAt(sourceSlot))->values.values;
+  Value* target = AS_LIST(*stackAt(targetSlot))->values.values;
+  for (int from = 0; from < count; from += SORT_RUN) {
+    int to = (from + SORT_RUN < count) ? from + SORT_RUN : count;
+    if (!insertionSort(base, source, from, to)) {
+      return NIL_VAL;
+    }
+  }
+
+  for (int width = SORT_RUN; width < count; width *= 2) {
+    for (int from = 0; from < count; from += 2 * width) {
+      int middle = (from + width < count) ? from + width : count;
+      int to = (middle + width < count) ? middle + width : count;
+      if (middle == to) {
+        memcpy(&target[from], &source[from], (to - from) * sizeof(Value));
+      }
+      else if (!mergeRuns(base, source, target, from, middle, to)) {
+        return NIL_VAL;
+      }
+      writeBarrierAll(AS_OBJ(*stackAt(targetSlot)));
+    }
+    Value* swap = source;
+    source = target;
+    target = swap;
+    int swapSlot = sourceSlot;
+    sourceSlot = targetSlot;
+    targetSlot = swapSlot;
+  }
+
+  ObjList* list = AS_LIST(stackAt(base)[0]);
+  if (list->values.count != count) {
+    return nativeError("List changed size while sorting.");
+  }
+  memcpy(list->values.values, source, count * sizeof(Value));
+  writeBarrierAll((Obj*)list);
+  pop();
+  pop();
+  return NIL_VAL;
+}
+
 void initCoreList() {
   defineNative("_list_add_", _list_add_);
   defineNative("_list_del_", _list_del_);
+  defineNative("_list_extend_", _list_extend_);
+  defineNative("_list_filter_", _list_filter_);
   defineNative("_list_get_", _list_get_);
+  defineNative("_list_index_of_", _list_index_of_);
   defineNative("_list_insert_", _list_insert_);
+  defineNative("_list_iter_", _list_iter_);
   defineNative("_list_len_", _list_len_);
+  defineNative("_list_map_", _list_map_);
   defineNative("_list_new_", _list_new_);
+  defineNative("_list_reduce_", _list_reduce_);
+  defineNative("_list_reverse_", _list_reverse_);
   defineNative("_list_set_", _list_set_);
+  defineNative("_list_slice_", _list_slice_);
+  defineNative("_list_sort_", _list_sort_);
   defineNative("_list_str_", _list_str_);
 }
 
 // ----------------------------------------------------------------------
 
+// Append the string of a value, growing the buffer geometrically so that
+// building a string of n characters copies O(n) of them.
+static Value _buffer_add_(int argc, Value* argv) {
+  // FIXME: check that there are two values
+  // FIXME: check that the first is a buffer
+  Value value = IS_STRING(argv[1]) ? argv[1] : valueToString(argv[1]);
+  ObjString* string = AS_STRING(value);
+  ObjBuffer* buffer = AS_BUFFER(argv[0]);
+  int length = buffer->length + string->length;
+  if (length > buffer->capacity) {
+    int oldCapacity = buffer->capacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    while (capacity < length) {
+      capacity = GROW_CAPACITY(capacity);
+    }
+    push(value);
+    buffer->chars = GROW_ARRAY(char, buffer->chars, oldCapacity, capacity);
+    buffer->capacity = capacity;
+    pop();
+  }
+  memcpy(buffer->chars + buffer->length, string->chars, string->length);
+  buffer->length = length;
+  return NIL_VAL;
+}
+
+static Value _buffer_len_(int argc, Value* argv) {
+  // FIXME: check that there is just one value
+  // FIXME: check that the value is a buffer
+  return NUMBER_VAL(AS_BUFFER(argv[0])->length);
+}
+
+static Value _buffer_new_(int argc, Value* argv) {
+  // FIXME: check that there are no arguments
+  return OBJ_VAL(newCoreBuffer());
+}
+
+// The contents become a string, and are hashed and interned, only here.
+static Value _buffer_str_(int argc, Value* argv) {
+  return valueToString(argv[0]);
+}
+
+void initCoreBuffer() {
+  defineNative("_buf_add_", _buffer_add_);
+  defineNative("_buf_len_", _buffer_len_);
+  defineNative("_buf_new_", _buffer_new_);
+  defineNative("_buf_str_", _buffer_str_);
+}
+
+// ----------------------------------------------------------------------
+
 void printCoreTable(ObjTable* table) {
-  printTable(&table->values);
+  printMap(&table->values);
 }
 
 static Value _table_del_(int argc, Value* argv) {
   // FIXME: check that there are two values
   // FIXME: check that the first is a table
-  // FIXME: check that the second is a string
   ObjTable* table = (ObjTable*)AS_OBJ(argv[0]);
-  ObjString* key = AS_STRING(argv[1]);
-  tableDelete(&table->values, key);
+  mapDelete(&table->values, argv[1]);
   return NIL_VAL;
 }
 
 static Value _table_get_(int argc, Value* argv) {
   // FIXME: check that there are two values
   // FIXME: check that the first is a table
-  // FIXME: check that the second is a string
   ObjTable* table = (ObjTable*)AS_OBJ(argv[0]);
-  ObjString* key = AS_STRING(argv[1]);
   Value value;
-  if (tableGet(&table->values, key, &value)) {
+  if (mapGet(&table->values, argv[1], &value)) {
     return value;
   }
   return NIL_VAL;
@@ -290,7 +748,7 @@ static Value _table_len_(int argc, Value* argv) {
   // FIXME: check that there is just one value
   // FIXME: check that the value is a table
   ObjTable* table = (ObjTable*)AS_OBJ(argv[0]);
-  return NUMBER_VAL(countTableLive(&table->values));
+  return NUMBER_VAL(table->values.count);
 }
 
 static Value _table_new_(int argc, Value* argv) {
@@ -302,11 +760,11 @@ static Value _table_new_(int argc, Value* argv) {
 static Value _table_set_(int argc, Value* argv) {
   // FIXME: check that there are three values
   // FIXME: check that the first is a table
-  // FIXME: check that the second is a string
   ObjTable* table = (ObjTable*)AS_OBJ(argv[0]);
-  ObjString* key = AS_STRING(argv[1]);
+  Value key = mapKey(argv[1]);
   Value value = argv[2];
-  tableSet(&table->values, key, value);
+  mapSet(&table->values, key, value);
+  writeBarrierMapEntry((Obj*)table, key, value);
   return NIL_VAL;
 }
 
@@ -314,35 +772,234 @@ static Value _table_str_(int argc, Value* argv) {
   return valueToString(argv[0]);
 }
 
+static Value _table_entries_(int argc, Value* argv) {
+  // FIXME: check that the value is a table
+  return iterate(AS_OBJ(argv[0]), ITERATE_ENTRIES);
+}
+
+static Value _table_keys_(int argc, Value* argv) {
+  // FIXME: check that the value is a table
+  return iterate(AS_OBJ(argv[0]), ITERATE_KEYS);
+}
+
+static Value _table_values_(int argc, Value* argv) {
+  // FIXME: check that the value is a table
+  return iterate(AS_OBJ(argv[0]), ITERATE_VALUES);
+}
+
 void initCoreTable() {
   defineNative("_tbl_del_", _table_del_);
+  defineNative("_tbl_entries_", _table_entries_);
   defineNative("_tbl_get_", _table_get_);
+  defineNative("_tbl_keys_", _table_keys_);
   defineNative("_tbl_len_", _table_len_);
   defineNative("_tbl_new_", _table_new_);
   defineNative("_tbl_set_", _table_set_);
   defineNative("_tbl_str_", _table_str_);
+  defineNative("_tbl_values_", _table_values_);
+}
+
+// ----------------------------------------------------------------------
+
+// range(start, end) or range(start, end, step), the step being 1 if it
+// isn't given.
+static Value _range_(int argc, Value* argv) {
+  if ((argc < 2) || (argc > 3)) {
+    return nativeError("range() takes a start, an end and an optional step.");
+  }
+  double step = 1;
+  if (argc == 3) {
+    if (!IS_NUMBER(argv[2])) {
+      return nativeError("Range step must be a number.");
+    }
+    step = AS_NUMBER(argv[2]);
+  }
+  if (!IS_NUMBER(argv[0]) || !IS_NUMBER(argv[1])) {
+    return nativeError("Range start and end must be numbers.");
+  }
+  if ((step == 0) || isnan(step)) {
+    return nativeError("Range step must not be zero.");
+  }
+
+  ObjRange* range = newCoreRange(AS_NUMBER(argv[0]), AS_NUMBER(argv[1]), step);
+  push(OBJ_VAL(range));
+  ObjInstance* instance = newCoreInstance(strRangeClass_, (Obj*)range);
+  pop();
+  return (instance == NULL) ? NIL_VAL : OBJ_VAL(instance);
+}
+
+static Value _range_iter_(int argc, Value* argv) {
+  // FIXME: check that there is just one value
+  // FIXME: check that the value is a range
+  return iterate(AS_OBJ(argv[0]), ITERATE_RANGE);
+}
+
+void initCoreRange() {
+  defineNative("range", _range_);
+  defineNative("_range_iter_", _range_iter_);
 }
 
 // ----------------------------------------------------------------------
 
+// The value at a position of a range, computed afresh rather than
+// stepped to, so that errors don't add up.
+static inline double rangeAt(ObjRange* range, int64_t position) {
+  return range->start + position * range->step;
+}
+
+static inline bool rangeHas(ObjRange* range, double value) {
+  return (range->step > 0) ? (value < range->end) : (value > range->end);
+}
+
+// Move a walk through a table to its next entry, if it has one. Fails if
+// the table has gained or lost keys since the iterator was made.
+static bool advanceTable(ObjIterator* iterator) {
+  Map* map = &((ObjTable*)iterator->source)->values;
+  if (iterator->version != map->version) {
+    nativeError("Table changed size while iterating.");
+    return false;
+  }
+  iterator->position = mapLiveFrom(map, (int)iterator->position);
+  return iterator->position < map->used;
+}
+
+static bool iteratorDone(ObjIterator* iterator) {
+  switch (iterator->kind) {
+    case ITERATE_LIST:
+      return iterator->position >= ((ObjList*)iterator->source)->values.count;
+    case ITERATE_RANGE: {
+      ObjRange* range = (ObjRange*)iterator->source;
+      return !rangeHas(range, rangeAt(range, iterator->position));
+    }
+    case ITERATE_KEYS:
+    case ITERATE_VALUES:
+    case ITERATE_ENTRIES:
+      return !advanceTable(iterator);
+  }
+  return true;
+}
+
+// A List of a key and its value.
+static Value entryPair(MapEntry* entry) {
+  ObjList* list = newCoreList();
+  push(OBJ_VAL(list));
+  listAppend(list, entry->key);
+  listAppend(list, entry->value);
+  ObjInstance* instance = newCoreInstance(strListClass_, (Obj*)list);
+  pop();
+  return (instance == NULL) ? NIL_VAL : OBJ_VAL(instance);
+}
+
+// Take the iterator's next value. Returns false once the iterator is
+// done, or if it has failed, in which case vm_.nativeError is set.
+bool iteratorNext(ObjIterator* iterator, Value* value) {
+  if (iteratorDone(iterator)) {
+    return false;
+  }
+
+  int64_t position = iterator->position++;
+  switch (iterator->kind) {
+    case ITERATE_LIST:
+      *value = ((ObjList*)iterator->source)->values.values[position];
+      return true;
+    case ITERATE_RANGE:
+      *value = NUMBER_VAL(rangeAt((ObjRange*)iterator->source, position));
+      return true;
+    case ITERATE_KEYS:
+    case ITERATE_VALUES:
+    case ITERATE_ENTRIES:
+      break;
+  }
+
+  MapEntry* entry = &((ObjTable*)iterator->source)->values.entries[position];
+  if (iterator->kind == ITERATE_KEYS) {
+    *value = entry->key;
+  }
+  else if (iterator->kind == ITERATE_VALUES) {
+    *value = entry->value;
+  }
+  else {
+    *value = entryPair(entry);
+  }
+  return true;
+}
+
+static Value _iterator_done_(int argc, Value* argv) {
+  // FIXME: check that there is just one value
+  // FIXME: check that the value is an iterator
+  return BOOL_VAL(iteratorDone(AS_ITERATOR(argv[0])));
+}
+
+// Returns nil once the iterator is done.
+static Value _iterator_next_(int argc, Value* argv) {
+  // FIXME: check that there is just one value
+  // FIXME: check that the value is an iterator
+  Value value;
+  return iteratorNext(AS_ITERATOR(argv[0]), &value) ? value : NIL_VAL;
+}
+
+void initCoreIterator() {
+  defineNative("_iter_done_", _iterator_done_);
+  defineNative("_iter_next_", _iterator_next_);
+}
+
+// ----------------------------------------------------------------------
+
+// A function that a native such as List.map() calls runs to completion
+// inside the native, so it cannot leave its fiber.
+static const char fiberSwitchError_[] = "Cannot switch fibers in a function called by a native.";
+
+// The new fiber keeps its function in its first stack slot, where the
+// function's frame will start.
 static Value _fiber_new_(int argc, Value* argv) {
+  // FIXME: check that there is one value
+  if (!IS_CLOSURE(argv[0])) {
+    return NIL_VAL;
+  }
   ObjFiber* fiber = newFiber(vm_.current);
+  *fiber->stackTop++ = argv[0];
   return OBJ_VAL(fiber);
 }
 
+static Value _fiber_done_(int argc, Value* argv) {
+  // FIXME: check that there is one value
+  return BOOL_VAL(IS_FIBER(argv[0]) && (AS_FIBER(argv[0])->state == FIBER_DONE));
+}
+
+// Switches to the fiber, so the result is whatever it yields or returns.
+// Running a fiber that is done or already running returns nil.
 static Value _fiber_run_(int argc, Value* argv) {
-  ObjFiber* fiber = AS_FIBER(argv[0]);
-  // FIXME: switch
-  return NIL_VAL; // FIXME
+  // FIXME: check that there are two values
+  if (vm_.callbackBase > 0) {
+    return nativeError(fiberSwitchError_);
+  }
+  if (!IS_FIBER(argv[0]) || !resumeFiber(AS_FIBER(argv[0]), argv[1])) {
+    return nativeError("Can only run a fiber that is new or suspended.");
+  }
+  return NIL_VAL;
+}
+
+static Value _fiber_spawn_(int argc, Value* argv) {
+  // FIXME: check that there is one value
+  if (IS_FIBER(argv[0]) && (AS_FIBER(argv[0])->state == FIBER_NEW)) {
+    spawnFiber(AS_FIBER(argv[0]));
+  }
+  return NIL_VAL;
 }
 
 static Value _fiber_yield_(int argc, Value* argv) {
-  return NIL_VAL; // FIXME
+  if (vm_.callbackBase > 0) {
+    return nativeError(fiberSwitchError_);
+  }
+  yieldFiber((argc > 0) ? argv[0] : NIL_VAL);
+  return NIL_VAL;
 }
 
 void initCoreFiber() {
+  defineNative("_fiber_done_", _fiber_done_);
   defineNative("_fiber_new_", _fiber_new_);
   defineNative("_fiber_run_", _fiber_run_);
+  defineNative("_fiber_spawn_", _fiber_spawn_);
   defineNative("yield", _fiber_yield_);
 }
 
@@ -351,6 +1008,9 @@ void initCoreFiber() {
 void initNative() {
   initCoreMisc();
   initCoreList();
+  initCoreBuffer();
   initCoreTable();
+  initCoreRange();
+  initCoreIterator();
   initCoreFiber();
 }
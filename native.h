@@ -14,6 +14,8 @@ void markCoreTable(ObjTable* table);
 void printCoreTable(ObjTable* table);
 void nativeCoreTable();
 
+bool iteratorNext(ObjIterator* iterator, Value* value);
+
 void initNative();
 
 #endif
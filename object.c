@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "config.h"
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -12,12 +13,18 @@
 
 static const char* object_type_names[] = {
   [OBJ_BOUND_METHOD] = "bound method",
+  [OBJ_BUFFER] = "buffer",
   [OBJ_CLASS] = "class",
   [OBJ_CLOSURE] = "closure",
+  [OBJ_FIBER] = "fiber",
   [OBJ_FUNCTION] = "function",
   [OBJ_INSTANCE] = "instance",
+  [OBJ_ITERATOR] = "iterator",
   [OBJ_NATIVE] = "native",
+  [OBJ_RANGE] = "range",
+  [OBJ_SHAPE] = "shape",
   [OBJ_STRING] = "string",
+  [OBJ_TABLE] = "table",
   [OBJ_UPVALUE] = "upvalue",
   [OBJ_LIST] = "list"
 };
@@ -27,12 +34,11 @@ const char* objectTypeName(ObjType type) {
 }
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = (Obj*)allocateObjectMemory(size);
   object->type = type;
-  object->isMarked = false;
-
-  object->next = vm_.objects;
-  vm_.objects = object;
+  object->isOld = false;
+  object->isRemembered = false;
+  object->isPinned = false;
 
   if (config_.dbg_gc) {
     print("%p allocate %zu for %s\n", (void*)object, size, objectTypeName(type));
@@ -52,6 +58,8 @@ ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods);
+  klass->fieldShadowsMethod = false;
+  klass->fieldCountHint = 0;
   return klass;
 }
 
@@ -77,9 +85,24 @@ void resetStack(ObjFiber* fiber) {
 static int fiberId_ = 0;
 
 ObjFiber* newFiber(ObjFiber* parent) {
+  // Allocate the stacks first so that the new fiber never has to be
+  // kept alive while they are allocated.
+  CallFrame* frames = ALLOCATE(CallFrame, FIBER_FRAMES_MIN);
+  Value* stack = ALLOCATE(Value, FIBER_STACK_MIN);
+
+  // The interpreter and the natives that switch fibers hold pointers to
+  // them, so fibers never move.
   ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+  fiber->obj.isPinned = true;
   fiber->id = fiberId_++;
+  fiber->state = FIBER_NEW;
   fiber->parent = parent;
+  fiber->caller = NULL;
+  fiber->next = NULL;
+  fiber->frames = frames;
+  fiber->frameCapacity = FIBER_FRAMES_MIN;
+  fiber->stack = stack;
+  fiber->stackCapacity = FIBER_STACK_MIN;
   resetStack(fiber);
   return fiber;
 }
@@ -96,7 +119,19 @@ ObjFunction* newFunction() {
 ObjInstance* newInstance(ObjClass* klass) {
   ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = vm_.emptyShape;
+  instance->fieldCapacity = 0;
+  instance->fields = NULL;
+  instance->dictionary = NULL;
+
+  // Size the field array for the number of fields earlier instances of
+  // this class ended up with.
+  if (klass->fieldCountHint > 0) {
+    push(OBJ_VAL(instance));
+    instance->fields = ALLOCATE(Value, klass->fieldCountHint);
+    instance->fieldCapacity = klass->fieldCountHint;
+    pop();
+  }
   return instance;
 }
 
@@ -106,50 +141,107 @@ ObjNative* newNative(NativeFn function) {
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->slotCount = (parent == NULL) ? 0 : parent->slotCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+static ObjString* allocateString(char* chars, int length) {
   ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
-  string->hash = hash;
+  string->hash = 0;
+  string->isHashed = false;
+  string->isInterned = false;
+  return string;
+}
 
+static void addInterned(ObjString* string, uint32_t hash) {
+  string->hash = hash;
+  string->isHashed = true;
+  string->isInterned = true;
   push(OBJ_VAL(string));
   tableSet(&vm_.strings, string, NIL_VAL);
   pop();
-
-  return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (Byte)key[i];
-    hash *= 16777619;
+
+// A string on a page the lazy sweep has not reached yet may be unmarked
+// and about to be freed, so finding it in the intern table revives it.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+  ObjString* interned = tableFindString(&vm_.strings, chars, length, hash);
+  if ((interned != NULL) && slabPageOf(interned)->needsSweep) {
+    slabMark(interned);
   }
-  return hash;
+  return interned;
 }
 
 ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm_.strings, chars, length, hash);
+  if (length > STRING_INTERN_LIMIT) {
+    return allocateString(chars, length);
+  }
+
+  uint32_t hash = hashBytes(chars, length);
+  ObjString* interned = findInterned(chars, length, hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
   }
 
-  return allocateString(chars, length, hash);
+  ObjString* string = allocateString(chars, length);
+  addInterned(string, hash);
+  return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm_.strings, chars, length, hash);
-  if (interned != NULL) {
-    return interned;
+  uint32_t hash = 0;
+  if (length <= STRING_INTERN_LIMIT) {
+    hash = hashBytes(chars, length);
+    ObjString* interned = findInterned(chars, length, hash);
+    if (interned != NULL) {
+      return interned;
+    }
   }
 
   char* heapChars = ALLOCATE(char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(heapChars, length);
+  if (length <= STRING_INTERN_LIMIT) {
+    addInterned(string, hash);
+  }
+  return string;
+}
+
+// The interned string equal to 'string', or NULL if there is none, in
+// which case no table has it as a key. Does not allocate, and hashes a
+// string at most once however often it is looked up.
+ObjString* findString(ObjString* string) {
+  if (string->isInterned) {
+    return string;
+  }
+  if (!string->isHashed) {
+    string->hash = hashBytes(string->chars, string->length);
+    string->isHashed = true;
+  }
+  return findInterned(string->chars, string->length, string->hash);
+}
+
+// The interned string equal to 'string', which becomes that string if
+// there is none yet. Tables compare keys by identity, so a string must
+// go through this before it is stored as one. It may allocate, so the
+// string must be reachable.
+ObjString* internString(ObjString* string) {
+  ObjString* interned = findString(string);
+  if (interned != NULL) {
+    return interned;
+  }
+  addInterned(string, string->hash);
+  return string;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -160,14 +252,41 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 
+ObjBuffer* newCoreBuffer() {
+  ObjBuffer* buffer = ALLOCATE_OBJ(ObjBuffer, OBJ_BUFFER);
+  buffer->length = 0;
+  buffer->capacity = 0;
+  buffer->chars = NULL;
+  return buffer;
+}
+
 ObjList* newCoreList() {
   ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
   initValueArray(&list->values);
+  list->front = 0;
   return list;
 }
 
 ObjTable* newCoreTable() {
   ObjTable* table = ALLOCATE_OBJ(ObjTable, OBJ_TABLE);
-  initTable(&table->values);
+  initMap(&table->values);
   return table;
 }
+
+ObjRange* newCoreRange(double start, double end, double step) {
+  ObjRange* range = ALLOCATE_OBJ(ObjRange, OBJ_RANGE);
+  range->start = start;
+  range->end = end;
+  range->step = step;
+  return range;
+}
+
+// Only a walk through a table keeps a version, that of the table.
+ObjIterator* newCoreIterator(Obj* source, IteratorKind kind) {
+  ObjIterator* iterator = ALLOCATE_OBJ(ObjIterator, OBJ_ITERATOR);
+  iterator->kind = kind;
+  iterator->position = 0;
+  iterator->version = (source->type == OBJ_TABLE) ? ((ObjTable*)source)->values.version : 0;
+  iterator->source = source;
+  return iterator;
+}
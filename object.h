@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "map.h"
 #include "table.h"
 #include "value.h"
 
@@ -15,24 +16,32 @@ typedef enum {
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_BUFFER(value)       isObjType(value, OBJ_BUFFER)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_ITERATOR(value)     isObjType(value, OBJ_ITERATOR)
 #define IS_LIST(value)         isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_RANGE(value)        isObjType(value, OBJ_RANGE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define IS_TABLE(value)        isObjType(value, OBJ_TABLE)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_BUFFER(value)       ((ObjBuffer*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_ITERATOR(value)     ((ObjIterator*)AS_OBJ(value))
 #define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_RANGE(value)        ((ObjRange*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_TABLE(value)        ((ObjTable*)AS_OBJ(value))
 
@@ -40,22 +49,30 @@ typedef enum {
 
 typedef enum {
   OBJ_BOUND_METHOD,
+  OBJ_BUFFER,
   OBJ_CLASS,
   OBJ_CLOSURE,
   OBJ_FIBER,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
+  OBJ_ITERATOR,
   OBJ_LIST,
   OBJ_NATIVE,
+  OBJ_RANGE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_TABLE,
   OBJ_UPVALUE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// The header fits in a byte. Mark bits are kept by the slab pages.
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj* next;
+  uint8_t type : 5;         // An ObjType.
+  uint8_t isOld : 1;        // Survived a collection.
+  uint8_t isRemembered : 1; // In the remembered set.
+  uint8_t isPinned : 1;     // Never moved by compaction.
 };
 
 typedef struct {
@@ -71,11 +88,18 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
+// Strings up to this length are interned as they are created. Longer
+// ones are only hashed and interned once used as a table key, so two
+// equal strings may be different objects unless both are interned.
+#define STRING_INTERN_LIMIT 64
+
 struct ObjString {
   Obj obj;
   int length;
   char* chars;
-  uint32_t hash;
+  uint32_t hash;    // Only valid once the string is hashed.
+  bool isHashed;    // Interned strings always are, longer ones once looked up.
+  bool isInterned;
 };
 
 typedef struct ObjUpvalue {
@@ -96,26 +120,59 @@ typedef struct {
   Obj obj;
   ObjString* name;
   Table methods;
+  bool fieldShadowsMethod;
+  int fieldCountHint;
 } ObjClass;
 
+// A shape (hidden class) records the names of an instance's fields in
+// the order they were added. Each shape adds one field to its parent,
+// so the field's slot is slotCount - 1. Instances that add the same
+// fields in the same order share shapes.
+typedef struct ObjShape ObjShape;
+
+struct ObjShape {
+  Obj obj;
+  ObjShape* parent;
+  ObjString* name;
+  int slotCount;
+  Table transitions;
+};
+
+// Instances with more fields than this switch to dictionary mode.
+#define SHAPE_MAX_FIELDS 32
+
 typedef struct {
   ObjClosure* closure;
   Byte* ip;
   Value* slots;
 } CallFrame;
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * BYTE_HEIGHT)
+// Fibers start with room for a few frames and one frame's worth of
+// values, and grow both arrays on demand up to config_.max_depth frames.
+#define FIBER_FRAMES_MIN 8
+#define FIBER_STACK_MIN BYTE_HEIGHT
+
+typedef enum {
+  FIBER_NEW,        // Function not called yet.
+  FIBER_RUNNING,    // Current, or waiting for a fiber it ran.
+  FIBER_SUSPENDED,  // Yielded.
+  FIBER_DONE
+} FiberState;
 
 typedef struct ObjFiber ObjFiber;
 
 struct ObjFiber {
   Obj obj;
   int id;
+  FiberState state;
   ObjFiber* parent;
-  CallFrame frames[FRAMES_MAX];
+  ObjFiber* caller;  // Fiber that ran this one and receives what it yields.
+  ObjFiber* next;    // Next fiber in the ready queue.
+  CallFrame* frames;
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  Value* stack;
+  int stackCapacity;
   Value* stackTop;
   ObjUpvalue* openUpvalues;
 };
@@ -123,7 +180,10 @@ struct ObjFiber {
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields;
+  ObjShape* shape;    // NULL in dictionary mode
+  int fieldCapacity;
+  Value* fields;      // Slot values while the instance has a shape.
+  Table* dictionary;  // Field table in dictionary mode.
 } ObjInstance;
 
 typedef struct {
@@ -132,16 +192,58 @@ typedef struct {
   ObjClosure* method;
 } ObjBoundMethod;
 
+// Characters appended a piece at a time, for building a string without
+// creating, hashing and interning every intermediate one.
+typedef struct {
+  Obj obj;
+  int length;
+  int capacity;
+  char* chars;
+} ObjBuffer;
+
+// The items are values.values[0] to values.values[values.count - 1],
+// which list.c keeps 'front' slots into their array.
 typedef struct {
   Obj obj;
   ValueArray values;
+  int front;
 } ObjList;
 
 typedef struct {
   Obj obj;
-  Table values;
+  Map values;
 } ObjTable;
 
+// Numbers from start up to but not including end, step apart, made one
+// at a time as they are iterated.
+typedef struct {
+  Obj obj;
+  double start;
+  double end;
+  double step;
+} ObjRange;
+
+typedef enum {
+  ITERATE_KEYS,
+  ITERATE_VALUES,
+  ITERATE_ENTRIES,
+  ITERATE_LIST,
+  ITERATE_RANGE
+} IteratorKind;
+
+// A walk through a list, a range, or the entries of a table in the order
+// their keys were added. A walk through a table stops being valid when a
+// key is added to or deleted from the table, which changes the table's
+// version. A list can change freely, the walk ending wherever the list
+// does.
+typedef struct {
+  Obj obj;
+  IteratorKind kind;
+  int64_t position;  // Wide enough for a range of more than INT_MAX steps.
+  uint32_t version;
+  Obj* source;
+} ObjIterator;
+
 const char* objectTypeName(ObjType type);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
@@ -151,11 +253,17 @@ ObjFiber* newFiber(ObjFiber* parent);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
+ObjShape* newShape(ObjShape* parent, ObjString* name);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* findString(ObjString* string);
+ObjString* internString(ObjString* string);
 ObjUpvalue* newUpvalue(Value* slot);
+ObjBuffer* newCoreBuffer();
 ObjList* newCoreList();
 ObjTable* newCoreTable();
+ObjRange* newCoreRange(double start, double end, double step);
+ObjIterator* newCoreIterator(Obj* source, IteratorKind kind);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
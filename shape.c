@@ -0,0 +1,131 @@
+#include "memory.h"
+#include "object.h"
+#include "shape.h"
+#include "table.h"
+#include "vm.h"
+
+// Slot holding a field, or -1 if the shape does not include it.
+int shapeFindSlot(ObjShape* shape, ObjString* name) {
+  for (; shape->parent != NULL; shape = shape->parent) {
+    if (shape->name == name) {
+      return shape->slotCount - 1;
+    }
+  }
+  return -1;
+}
+
+// Shape produced by adding a field, shared by every instance that adds
+// the same fields in the same order.
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+
+  ObjShape* child = newShape(shape, name);
+  push(OBJ_VAL(child));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrierEntry((Obj*)shape, name, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+// Move an instance's fields into a table of its own.
+static void makeDictionary(ObjInstance* instance) {
+  instance->dictionary = ALLOCATE(Table, 1);
+  initTable(instance->dictionary);
+  for (ObjShape* shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+    Value value = instance->fields[shape->slotCount - 1];
+    tableSet(instance->dictionary, shape->name, value);
+    writeBarrierEntry((Obj*)instance, shape->name, value);
+  }
+
+  FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->shape = NULL;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dictionary, name, value);
+  }
+
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot == -1) {
+    return false;
+  }
+  *value = instance->fields[slot];
+  return true;
+}
+
+static bool dictionarySet(ObjInstance* instance, ObjString* name, Value value) {
+  bool isNew = tableSet(instance->dictionary, name, value);
+  writeBarrierEntry((Obj*)instance, name, value);
+  return isNew;
+}
+
+// Set a field, returning true if it is new. The value must be reachable
+// by the garbage collector, since adding a field may allocate.
+bool instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+  if (instance->shape == NULL) {
+    return dictionarySet(instance, name, value);
+  }
+
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot != -1) {
+    instance->fields[slot] = value;
+    writeBarrier((Obj*)instance, value);
+    return false;
+  }
+
+  if (instance->shape->slotCount == SHAPE_MAX_FIELDS) {
+    makeDictionary(instance);
+    return dictionarySet(instance, name, value);
+  }
+
+  ObjShape* shape = shapeTransition(instance->shape, name);
+  if (shape->slotCount > instance->fieldCapacity) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = (oldCapacity < 4) ? 4 : oldCapacity * 2;
+    instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+    instance->fieldCapacity = capacity;
+  }
+  instance->fields[shape->slotCount - 1] = value;
+  instance->shape = shape;
+  writeBarrier((Obj*)instance, value);
+  writeBarrier((Obj*)instance, OBJ_VAL(shape));
+
+  if (shape->slotCount > instance->klass->fieldCountHint) {
+    instance->klass->fieldCountHint = shape->slotCount;
+  }
+  return true;
+}
+
+// Slot holding a field if the instance has a shape, or -1.
+int instanceFieldSlot(ObjInstance* instance, ObjString* name) {
+  if (instance->shape == NULL) {
+    return -1;
+  }
+  return shapeFindSlot(instance->shape, name);
+}
+
+void markInstanceFields(ObjInstance* instance) {
+  if (instance->shape != NULL) {
+    markObject((Obj*)instance->shape);
+    for (int i = 0; i < instance->shape->slotCount; i++) {
+      markValue(instance->fields[i]);
+    }
+  }
+  if (instance->dictionary != NULL) {
+    markTable(instance->dictionary);
+  }
+}
+
+void freeInstanceFields(ObjInstance* instance) {
+  FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  if (instance->dictionary != NULL) {
+    freeTable(instance->dictionary);
+    FREE(Table, instance->dictionary);
+  }
+}
@@ -0,0 +1,14 @@
+#ifndef shape_h
+#define shape_h
+
+#include "object.h"
+#include "value.h"
+
+int shapeFindSlot(ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+bool instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+int instanceFieldSlot(ObjInstance* instance, ObjString* name);
+void markInstanceFields(ObjInstance* instance);
+void freeInstanceFields(ObjInstance* instance);
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+static int classIndex(size_t size) {
+  return (int)((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+static size_t slotSize(int index) {
+  return (size_t)(index + 1) * SLAB_GRANULE;
+}
+
+static void resetPage(SlabPage* page) {
+  page->freeList = NULL;
+  page->bump = page->slots;
+  page->liveCount = 0;
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->marked, 0, sizeof(page->marked));
+}
+
+static bool pageIsFull(SlabPage* page) {
+  return (page->freeList == NULL) && (page->bump + page->slotSize > page->end);
+}
+
+// The slots start after the page header, rounded up to a granule.
+static size_t headerSize() {
+  return (sizeof(SlabPage) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1);
+}
+
+static SlabPage* newPage(Slabs* slabs, SlabClass* sizeClass, size_t size) {
+  size_t header = headerSize();
+  size_t pageSize = SLAB_PAGE_SIZE;
+  if (header + size > pageSize) {
+    pageSize = (header + size + SLAB_PAGE_SIZE - 1) & ~(size_t)(SLAB_PAGE_SIZE - 1);
+  }
+
+  SlabPage* page = (SlabPage*)aligned_alloc(SLAB_PAGE_SIZE, pageSize);
+  if (page == NULL) {
+    exit(1);
+  }
+  page->slots = (char*)page + header;
+  page->end = (char*)page + pageSize;
+  page->slotSize = size;
+  page->isNew = false;
+  page->needsSweep = false;
+  page->isEvacuating = false;
+  resetPage(page);
+
+  page->next = sizeClass->pages;
+  sizeClass->pages = page;
+  page->nextAvailable = sizeClass->available;
+  sizeClass->available = page;
+  page->isAvailable = true;
+  slabs->pageCount++;
+  return page;
+}
+
+void initSlabs(Slabs* slabs, SlabPageFn sweep) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    slabs->classes[i].pages = NULL;
+    slabs->classes[i].available = NULL;
+  }
+  slabs->large.pages = NULL;
+  slabs->large.available = NULL;
+  slabs->newPages = NULL;
+  slabs->sweep = sweep;
+  slabs->pageCount = 0;
+}
+
+static void freePages(SlabPage* page) {
+  while (page != NULL) {
+    SlabPage* next = page->next;
+    free(page);
+    page = next;
+  }
+}
+
+void freeSlabs(Slabs* slabs) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    freePages(slabs->classes[i].pages);
+  }
+  freePages(slabs->large.pages);
+  initSlabs(slabs, slabs->sweep);
+}
+
+void* slabAllocate(Slabs* slabs, size_t size) {
+  SlabClass* sizeClass;
+  SlabPage* page;
+  if (size > SLAB_MAX_SIZE) {
+    sizeClass = &slabs->large;
+    page = newPage(slabs, sizeClass, size);
+  }
+  else {
+    int index = classIndex(size);
+    sizeClass = &slabs->classes[index];
+    page = sizeClass->available;
+    if (page == NULL) {
+      page = newPage(slabs, sizeClass, slotSize(index));
+    }
+    else if (page->needsSweep) {
+      slabs->sweep(page);
+    }
+  }
+
+  void* slot;
+  if (page->freeList != NULL) {
+    slot = page->freeList;
+    page->freeList = page->freeList->next;
+  }
+  else {
+    slot = page->bump;
+    page->bump += page->slotSize;
+  }
+  // A new slot is unmarked.
+  int index = slabSlotIndex(page, slot);
+  page->allocated[index / 64] |= (uint64_t)1 << (index % 64);
+  page->marked[index / 64] &= ~((uint64_t)1 << (index % 64));
+  page->liveCount++;
+
+  if (pageIsFull(page)) {
+    sizeClass->available = page->nextAvailable;
+    page->isAvailable = false;
+  }
+  if (!page->isNew) {
+    page->isNew = true;
+    page->nextNew = slabs->newPages;
+    slabs->newPages = page;
+  }
+  return slot;
+}
+
+// Free a slot without making its page available for allocation. This only
+// touches the page, so different pages can be freed from in parallel, but
+// the available lists must then be rebuilt with slabReleaseEmpty().
+void slabFreeInPage(void* pointer) {
+  SlabPage* page = slabPageOf(pointer);
+  int index = slabSlotIndex(page, pointer);
+  page->allocated[index / 64] &= ~((uint64_t)1 << (index % 64));
+
+  SlabSlot* slot = (SlabSlot*)pointer;
+  slot->next = page->freeList;
+  page->freeList = slot;
+  page->liveCount--;
+}
+
+void slabFree(Slabs* slabs, void* pointer) {
+  slabFreeInPage(pointer);
+
+  SlabPage* page = slabPageOf(pointer);
+  if (!page->isAvailable && (page->slotSize <= SLAB_MAX_SIZE)) {
+    SlabClass* sizeClass = &slabs->classes[classIndex(page->slotSize)];
+    page->nextAvailable = sizeClass->available;
+    sizeClass->available = page;
+    page->isAvailable = true;
+  }
+}
+
+// Call 'fn' on every allocated slot of a page. It may free the slot.
+void slabEachInPage(SlabPage* page, SlabSlotFn fn) {
+  int words = (int)((page->bump - page->slots) / SLAB_GRANULE + 63) / 64;
+  if (words > SLAB_BITMAP_WORDS) {
+    words = SLAB_BITMAP_WORDS; // A large object's page.
+  }
+  for (int i = 0; i < words; i++) {
+    uint64_t bits = page->allocated[i];
+    while (bits != 0) {
+      int bit = __builtin_ctzll(bits);
+      bits &= bits - 1;
+      fn(page->slots + (size_t)(i * 64 + bit) * SLAB_GRANULE);
+    }
+  }
+}
+
+void slabClearMarks(SlabPage* page) {
+  memset(page->marked, 0, sizeof(page->marked));
+}
+
+static void eachInPages(SlabPage* page, SlabSlotFn fn) {
+  while (page != NULL) {
+    SlabPage* next = page->next;
+    slabEachInPage(page, fn);
+    page = next;
+  }
+}
+
+void slabEach(Slabs* slabs, SlabSlotFn fn) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    eachInPages(slabs->classes[i].pages, fn);
+  }
+  eachInPages(slabs->large.pages, fn);
+}
+
+void slabClearNew(Slabs* slabs) {
+  for (SlabPage* page = slabs->newPages; page != NULL; page = page->nextNew) {
+    page->isNew = false;
+  }
+  slabs->newPages = NULL;
+}
+
+static void unlinkNew(Slabs* slabs, SlabPage* released) {
+  for (SlabPage** page = &slabs->newPages; *page != NULL; page = &(*page)->nextNew) {
+    if (*page == released) {
+      *page = released->nextNew;
+      return;
+    }
+  }
+}
+
+static void releasePage(Slabs* slabs, SlabPage* page) {
+  if (page->isNew) {
+    unlinkNew(slabs, page);
+  }
+  free(page);
+  slabs->pageCount--;
+}
+
+// Give empty pages back to the system, keeping one per size class for the
+// next allocations, and rebuild the lists of pages with free slots. Called
+// after a sweep, when most slots are freed. Pages in use are refilled
+// before the spare one.
+void slabReleaseEmpty(Slabs* slabs) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    SlabClass* sizeClass = &slabs->classes[i];
+    SlabPage* spare = NULL;
+    SlabPage* pages = NULL;
+    SlabPage** available = &sizeClass->available;
+
+    SlabPage* page = sizeClass->pages;
+    while (page != NULL) {
+      SlabPage* next = page->next;
+      if (page->liveCount > 0) {
+        page->next = pages;
+        pages = page;
+        page->isAvailable = !pageIsFull(page);
+        if (page->isAvailable) {
+          *available = page;
+          available = &page->nextAvailable;
+        }
+      }
+      else if (spare == NULL) {
+        resetPage(page);
+        spare = page;
+      }
+      else {
+        releasePage(slabs, page);
+      }
+      page = next;
+    }
+
+    if (spare != NULL) {
+      spare->next = pages;
+      pages = spare;
+      spare->isAvailable = true;
+      *available = spare;
+      available = &spare->nextAvailable;
+    }
+    *available = NULL;
+    sizeClass->pages = pages;
+  }
+
+  SlabPage** page = &slabs->large.pages;
+  while (*page != NULL) {
+    SlabPage* current = *page;
+    if (current->liveCount == 0) {
+      *page = current->next;
+      releasePage(slabs, current);
+    }
+    else {
+      page = &current->next;
+    }
+  }
+  slabs->large.available = NULL;
+}
+
+int slabSlotsPerPage(size_t slotSize) {
+  return (int)((SLAB_PAGE_SIZE - headerSize()) / slotSize);
+}
+
+// How many pages of small objects would be left empty if the objects of
+// each size class were packed together.
+int slabSparePages(Slabs* slabs) {
+  int spare = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    int pages = 0;
+    int live = 0;
+    for (SlabPage* page = slabs->classes[i].pages; page != NULL; page = page->next) {
+      if (page->liveCount > 0) {
+        pages++;
+        live += page->liveCount;
+      }
+    }
+    int perPage = slabSlotsPerPage(slotSize(i));
+    spare += pages - (live + perPage - 1) / perPage;
+  }
+  return spare;
+}
+
+// Take the pages flagged isEvacuating off the lists of pages with free
+// slots, so that the objects moved out of them are allocated elsewhere.
+void slabBeginEvacuation(Slabs* slabs) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    SlabPage** page = &slabs->classes[i].available;
+    while (*page != NULL) {
+      if ((*page)->isEvacuating) {
+        (*page)->isAvailable = false;
+        *page = (*page)->nextAvailable;
+      }
+      else {
+        page = &(*page)->nextAvailable;
+      }
+    }
+  }
+}
+
+// Release the pages flagged isEvacuating, once all their objects have
+// moved.
+void slabEndEvacuation(Slabs* slabs) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (SlabPage* page = slabs->classes[i].pages; page != NULL; page = page->next) {
+      if (page->isEvacuating) {
+        page->isEvacuating = false;
+        resetPage(page);
+      }
+    }
+  }
+  slabReleaseEmpty(slabs);
+}
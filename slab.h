@@ -0,0 +1,109 @@
+#ifndef slab_h
+#define slab_h
+
+#include "common.h"
+
+// Objects of up to SLAB_MAX_SIZE bytes are allocated from pages that hold
+// slots of a single size, in steps of SLAB_GRANULE bytes. Every Obj struct
+// fits, so objects of the same type end up next to each other. Larger
+// objects get a page of their own. Pages are aligned to SLAB_PAGE_SIZE so
+// that a slot's page can be found from its address, and each page keeps a
+// bitmap of its allocated slots so that the heap can be walked page by page.
+// The mark bits of the collector are kept in a second bitmap, so marking
+// writes to the page headers and not to the objects.
+#define SLAB_PAGE_SIZE (16 * 1024)
+#define SLAB_GRANULE 8
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_PAGE_GRANULES (SLAB_PAGE_SIZE / SLAB_GRANULE)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_GRANULES / 64)
+
+typedef struct SlabSlot {
+  struct SlabSlot* next;
+} SlabSlot;
+
+typedef struct SlabPage {
+  struct SlabPage* next;
+  struct SlabPage* nextAvailable;
+  struct SlabPage* nextNew;
+  SlabSlot* freeList;
+  char* slots;
+  char* bump;
+  char* end;
+  size_t slotSize;
+  int liveCount;
+  bool isAvailable;
+  bool isNew;      // Allocated from since the last slabClearNew().
+  bool needsSweep; // Must be swept before it is allocated from.
+  bool isEvacuating; // Being emptied by a compaction.
+  uint64_t allocated[SLAB_BITMAP_WORDS];
+  uint64_t marked[SLAB_BITMAP_WORDS];
+} SlabPage;
+
+typedef struct {
+  SlabPage* pages;
+  SlabPage* available; // Pages with a free slot.
+} SlabClass;
+
+typedef struct Slabs Slabs;
+typedef void (*SlabPageFn)(SlabPage* page);
+typedef void (*SlabSlotFn)(void* slot);
+
+struct Slabs {
+  SlabClass classes[SLAB_CLASSES];
+  SlabClass large;
+  SlabPage* newPages;
+  SlabPageFn sweep; // Called on a page that needs sweeping before use.
+  int pageCount;
+};
+
+static inline SlabPage* slabPageOf(void* pointer) {
+  return (SlabPage*)((uintptr_t)pointer & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+// The bitmaps have a bit per granule, set for the first granule of a slot,
+// which saves a division.
+static inline int slabSlotIndex(SlabPage* page, void* pointer) {
+  return (int)(((char*)pointer - page->slots) / SLAB_GRANULE);
+}
+
+static inline bool slabIsMarked(void* pointer) {
+  SlabPage* page = slabPageOf(pointer);
+  int index = slabSlotIndex(page, pointer);
+  return (page->marked[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void slabMark(void* pointer) {
+  SlabPage* page = slabPageOf(pointer);
+  int index = slabSlotIndex(page, pointer);
+  page->marked[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+// Mark a slot from one of several threads. Returns false if it was marked
+// already.
+static inline bool slabMarkAtomic(void* pointer) {
+  SlabPage* page = slabPageOf(pointer);
+  int index = slabSlotIndex(page, pointer);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  if (__atomic_load_n(&page->marked[index / 64], __ATOMIC_RELAXED) & bit) {
+    return false;
+  }
+  return !(__atomic_fetch_or(&page->marked[index / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+void initSlabs(Slabs* slabs, SlabPageFn sweep);
+void freeSlabs(Slabs* slabs);
+void* slabAllocate(Slabs* slabs, size_t size);
+void slabFree(Slabs* slabs, void* pointer);
+void slabFreeInPage(void* pointer);
+void slabClearMarks(SlabPage* page);
+void slabEachInPage(SlabPage* page, SlabSlotFn fn);
+void slabEach(Slabs* slabs, SlabSlotFn fn);
+void slabClearNew(Slabs* slabs);
+void slabReleaseEmpty(Slabs* slabs);
+int slabSlotsPerPage(size_t slotSize);
+int slabSparePages(Slabs* slabs);
+void slabBeginEvacuation(Slabs* slabs);
+void slabEndEvacuation(Slabs* slabs);
+
+#endif
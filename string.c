@@ -1,10 +1,13 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "constants.h"
 #include "memory.h"
+#include "map.h"
 #include "object.h"
 #include "string.h"
 #include "table.h"
+#include "vm.h"
 
 #define MAX_NUM_VALUES 10
 
@@ -15,13 +18,21 @@ static const int strEntrySepLen_ = 2;
 
 static Value objectToString(Value value);
 
+// asprintf() allocates outside of the heap's accounting, which would
+// then count the string's memory as freed without having allocated it.
+static Value takeFormatted(char* chars, int length) {
+  ObjString* string = copyString(chars, length);
+  free(chars);
+  return OBJ_VAL(string);
+}
+
 static Value functionToString(ObjFunction* function) {
   if (function->name == NULL) {
     return strScript_;
   }
   char* s = NULL;
   int len = asprintf(&s, "<fn %.*s>", function->name->length, function->name->chars);
-  return OBJ_VAL(takeString(s, len));
+  return takeFormatted(s, len);
 }
 
 static Value listToString(ObjList* list) {
@@ -36,7 +47,8 @@ static Value listToString(ObjList* list) {
   Value values[MAX_NUM_VALUES];
   for (int i=0; i<numValues; i++) {
     values[i] = valueToString(list->values.values[i]);
-    totalLen += AS_STRING(values[i])->length + strItemSepLen_;
+    push(values[i]); // Keep the string alive while converting the rest.
+    totalLen += AS_STRING(values[i])->length + ((i > 0) ? strItemSepLen_ : 0);
   }
 
   // Concatenate.
@@ -52,13 +64,16 @@ static Value listToString(ObjList* list) {
     current += sprintf(current, "%.*s", s->length, s->chars);
   }
   current += sprintf(current, "]");
+  for (int i=0; i<numValues; i++) {
+    pop();
+  }
 
   return OBJ_VAL(takeString(buffer, totalLen));
 }
 
 static Value tableToString(ObjTable* table) {
   // Setup.
-  int numValues = countTableLive(&table->values);
+  int numValues = table->values.count;
   if (numValues > MAX_NUM_VALUES) {
     numValues = MAX_NUM_VALUES;
   }
@@ -67,16 +82,18 @@ static Value tableToString(ObjTable* table) {
   int loc = 0;
   int totalLen = 0;
   Value values[2 * MAX_NUM_VALUES]; // key and value
-  for (int i=0; i<table->values.capacity; i++) {
-    ObjString* key = table->values.entries[i].key;
+  for (int i=0; i<table->values.used; i++) {
+    Value key = table->values.entries[i].key;
     Value value = table->values.entries[i].value;
-    if (key != NULL) {
-      values[loc] = OBJ_VAL(key);
+    if (!IS_EMPTY_KEY(key)) {
+      values[loc] = valueToString(key);
+      push(values[loc]);
       totalLen += AS_STRING(values[loc])->length + strEntrySepLen_;
       values[loc+1] = valueToString(value);
-      totalLen += AS_STRING(values[loc+1])->length + strItemSepLen_;
+      push(values[loc+1]); // Keep the string alive while converting the rest.
+      totalLen += AS_STRING(values[loc+1])->length + ((loc > 0) ? strItemSepLen_ : 0);
       loc += 2;
-      if (loc == numValues) {
+      if (loc == 2 * numValues) {
 	break;
       }
     }
@@ -87,7 +104,7 @@ static Value tableToString(ObjTable* table) {
   char* buffer = ALLOCATE(char, totalLen+1);
   char* current = buffer;
   current += sprintf(current, "{");
-  for (int i=0; i<numValues; i+=2) {
+  for (int i=0; i<loc; i+=2) {
     if (i > 0) {
       current += sprintf(current, "%s", strItemSep_);
     }
@@ -98,6 +115,9 @@ static Value tableToString(ObjTable* table) {
     current += sprintf(current, "%.*s", s->length, s->chars);
   }
   current += sprintf(current, "}");
+  for (int i=0; i<loc; i++) {
+    pop();
+  }
 
   return OBJ_VAL(takeString(buffer, totalLen));
 }
@@ -118,7 +138,7 @@ static Value objectToString(Value value) {
       ObjFiber* fiber = AS_FIBER(value);
       int len = asprintf(&s, "<fiber %d/%d>", fiber->id,
 			 (fiber->parent == NULL) ? -1 : fiber->parent->id);
-      return OBJ_VAL(takeString(s, len));
+      return takeFormatted(s, len);
     }
     case OBJ_FUNCTION: {
       return functionToString(AS_FUNCTION(value));
@@ -127,7 +147,14 @@ static Value objectToString(Value value) {
       ObjString* name = AS_INSTANCE(value)->klass->name;
       char* s = NULL;
       int len = asprintf(&s, "%.*s instance", name->length, name->chars);
-      return OBJ_VAL(takeString(s, len));
+      return takeFormatted(s, len);
+    }
+    case OBJ_BUFFER: {
+      ObjBuffer* buffer = AS_BUFFER(value);
+      return OBJ_VAL(copyString(buffer->chars, buffer->length));
+    }
+    case OBJ_ITERATOR: {
+      return strIterator_;
     }
     case OBJ_LIST: {
       return listToString(AS_LIST(value));
@@ -135,6 +162,12 @@ static Value objectToString(Value value) {
     case OBJ_NATIVE: {
       return strNativeFn_;
     }
+    case OBJ_RANGE: {
+      return strRange_;
+    }
+    case OBJ_SHAPE: {
+      return strShape_;
+    }
     case OBJ_STRING: {
       return value;
     }
@@ -158,9 +191,9 @@ Value valueToString(Value value) {
     return strNil_;
   }
   else if (IS_NUMBER(value)) {
-    char* buffer = NULL;
-    int len = asprintf(&buffer, "%g", AS_NUMBER(value));
-    return OBJ_VAL(takeString(buffer, len));
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(value));
+    return OBJ_VAL(copyString(buffer, len));
   }
   else if (IS_OBJ(value)) {
     return objectToString(value);
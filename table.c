@@ -9,9 +9,16 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Tables use Robin Hood hashing: an entry being inserted takes the place
+// of any entry nearer to its home slot, so that a lookup can stop as soon
+// as it passes entries nearer to theirs than the key would be. Deletion
+// shifts the entries after the deleted one back, so there are no
+// tombstones, and count is the number of keys.
+
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
+  table->version = 1;
   table->entries = NULL;
 }
 
@@ -21,13 +28,7 @@ void freeTable(Table* table) {
 }
 
 int countTableLive(Table* table) {
-  int result = 0;
-  for (int i=0; i<table->capacity; i++) {
-    if (table->entries[i].key != NULL) {
-      result++;
-    }
-  }
-  return result;
+  return table->count;
 }
 
 void printTable(Table* table) {
@@ -43,40 +44,57 @@ void printTable(Table* table) {
   }
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
+// How far the entry at 'index' is from its home slot.
+static inline uint32_t probeDistance(Table* table, uint32_t index) {
+  return (index - table->entries[index].key->hash) & (table->capacity - 1);
+}
 
-  for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      }
-      else {
-        // We found a tombstone.
-        if (tombstone == NULL) {
-	  tombstone = entry;
-	}
-      }
-    }
-    else if (entry->key == key) {
-      // We found the key.
+static Entry* findEntry(Table* table, ObjString* key) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = key->hash & mask;
+  for (uint32_t distance = 0; ; distance++) {
+    Entry* entry = &table->entries[index];
+    if (entry->key == key) {
       return entry;
     }
-
-    index = (index + 1) & (capacity - 1);
+    if ((entry->key == NULL) || (probeDistance(table, index) < distance)) {
+      return NULL;
+    }
+    index = (index + 1) & mask;
   }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
-  if (table->count == 0) {
-    return false;
+// Insert a key that is not in the table, which has room for it.
+static void insertEntry(Table* table, ObjString* key, Value value) {
+  Entry carried = {key, value};
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = key->hash & mask;
+  for (uint32_t distance = 0; ; distance++) {
+    Entry* entry = &table->entries[index];
+    if (entry->key == NULL) {
+      *entry = carried;
+      table->count++;
+      return;
+    }
+
+    uint32_t existing = probeDistance(table, index);
+    if (existing < distance) {
+      Entry evicted = *entry;
+      *entry = carried;
+      carried = evicted;
+      distance = existing;
+    }
+    index = (index + 1) & mask;
   }
+}
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  Entry* entry = findEntry(table, key);
+  if (entry == NULL) {
     return false;
   }
 
@@ -84,6 +102,13 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
   return true;
 }
 
+// Find where a key's value is stored, or NULL. The pointer stays valid
+// until the table's version changes.
+Value* tableGetSlot(Table* table, ObjString* key) {
+  Entry* entry = findEntry(table, key);
+  return (entry == NULL) ? NULL : &entry->value;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
   Entry* entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++) {
@@ -91,55 +116,61 @@ static void adjustCapacity(Table* table, int capacity) {
     entries[i].value = NIL_VAL;
   }
 
+  Entry* oldEntries = table->entries;
+  int oldCapacity = table->capacity;
+  table->entries = entries;
+  table->capacity = capacity;
   table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key == NULL) {
-      continue;
+  for (int i = 0; i < oldCapacity; i++) {
+    if (oldEntries[i].key != NULL) {
+      insertEntry(table, oldEntries[i].key, oldEntries[i].value);
     }
-
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  FREE_ARRAY(Entry, oldEntries, oldCapacity);
+  table->version++;
 }
 
+// Inserting moves other entries, so it changes the version like growing
+// the table does.
 bool tableSet(Table* table, ObjString* key, Value value) {
+  Entry* entry = findEntry(table, key);
+  if (entry != NULL) {
+    entry->value = value;
+    return false;
+  }
+
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
     adjustCapacity(table, capacity);
   }
-
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) {
-    table->count++;
-  }
-
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  insertEntry(table, key, value);
+  table->version++;
+  return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
-  if (table->count == 0) {
+  Entry* entry = findEntry(table, key);
+  if (entry == NULL) {
     return false;
   }
 
-  // Find the entry.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
-    return false;
+  // Shift the following entries back until one is empty or already in
+  // its home slot.
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = (uint32_t)(entry - table->entries);
+  for (;;) {
+    uint32_t next = (index + 1) & mask;
+    if ((table->entries[next].key == NULL) || (probeDistance(table, next) == 0)) {
+      break;
+    }
+    table->entries[index] = table->entries[next];
+    index = next;
   }
-
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
+  table->count--;
+  table->version++;
   return true;
 }
 
@@ -157,32 +188,19 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
     return NULL;
   }
 
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = hash & mask;
+  for (uint32_t distance = 0; ; distance++) {
     Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) {
-	return NULL;
-      }
+    if ((entry->key == NULL) || (probeDistance(table, index) < distance)) {
+      return NULL;
     }
-    else if ((entry->key->length == length) &&
-	     (entry->key->hash == hash) &&
-	     (memcmp(entry->key->chars, chars, length) == 0)) {
-      // We found it.
+    if ((entry->key->hash == hash) &&
+        (entry->key->length == length) &&
+        (memcmp(entry->key->chars, chars, length) == 0)) {
       return entry->key;
     }
-
-    index = (index + 1) & (table->capacity - 1);
-  }
-}
-
-void tableRemoveWhite(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if ((entry->key != NULL) && (!entry->key->obj.isMarked)) {
-      tableDelete(table, entry->key);
-    }
+    index = (index + 1) & mask;
   }
 }
 
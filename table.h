@@ -13,6 +13,7 @@ typedef struct {
 typedef struct {
   int count;
   int capacity;
+  uint32_t version;
   Entry* entries;
 } Table;
 
@@ -21,12 +22,12 @@ void freeTable(Table* table);
 int countTableLive(Table* table);
 void printTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+Value* tableGetSlot(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
 #endif
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../config.h"
+#include "../memory.h"
+#include "../vm.h"
+
+// Compare serial and parallel marking and sweeping on synthetic heaps of
+// instances, each holding a list and a table. The parallel runs use the
+// number of threads given with -t, or 4.
+
+#define REPEATS 3
+
+static const int sizes_[] = {25000, 100000, 400000, 0};
+
+// The best marking and sweeping times of a few full collections.
+static void gcTimes(int threads, double* mark, double* sweep) {
+  config_.gc_threads = threads;
+  *mark = -1;
+  *sweep = -1;
+  for (int i = 0; i < REPEATS; i++) {
+    collectGarbage();
+    if ((*mark < 0) || (vm_.markMicros < *mark)) {
+      *mark = vm_.markMicros;
+    }
+    if ((*sweep < 0) || (vm_.sweepMicros < *sweep)) {
+      *sweep = vm_.sweepMicros;
+    }
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  initConfig(argc, argv);
+  int threads = (config_.gc_threads > 1) ? config_.gc_threads : 4;
+
+  printf("%10s %8s %12s %12s %8s\n", "nodes", "phase", "serial us", "parallel us", "speedup");
+  for (int i = 0; sizes_[i] != 0; i++) {
+    char* source = NULL;
+    asprintf(&source,
+             "class N { init(i) { this.i = i; this.l = [i, \"x\"]; this.t = {\"k\": i}; } }"
+             "var heap = [];"
+             "for (var i = 0; i < %d; i = i + 1) heap.add(N(i));", sizes_[i]);
+
+    initVM();
+    config_.gc_threads = 1;
+    if (interpret(source) != INTERPRET_OK) {
+      fprintf(stderr, "Could not build the heap.\n");
+      exit(1);
+    }
+    double serialMark, serialSweep, parallelMark, parallelSweep;
+    gcTimes(1, &serialMark, &serialSweep);
+    gcTimes(threads, &parallelMark, &parallelSweep);
+    printf("%10d %8s %12.0f %12.0f %8.2f\n", sizes_[i], "mark",
+           serialMark, parallelMark, serialMark / parallelMark);
+    printf("%10d %8s %12.0f %12.0f %8.2f\n", sizes_[i], "sweep",
+           serialSweep, parallelSweep, serialSweep / parallelSweep);
+    freeVM();
+    free(source);
+  }
+
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../hash.h"
+
+// Compare the string hash on each code path the processor supports with
+// the byte-at-a-time FNV-1a it replaced, in bytes hashed per nanosecond,
+// and check that every path gives the same hashes.
+
+#define TOTAL_BYTES (256 * 1024 * 1024)
+
+static const int sizes_[] = {8, 24, 64, 256, 1024, 16 * 1024, 1024 * 1024, 0};
+
+static uint32_t fnv1a(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static double nowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Bytes per nanosecond of hashing the strings of 'size' bytes laid one
+// after another in 'data'. The sum of the hashes keeps the calls alive.
+static double throughput(uint32_t (*hash)(const char*, int), const char* data, int size,
+                         uint32_t* sum) {
+  int strings = TOTAL_BYTES / size;
+  if (strings > 4 * 1024 * 1024) {
+    strings = 4 * 1024 * 1024;
+  }
+  int span = (1024 * 1024) / size;
+  if (span < 1) {
+    span = 1;
+  }
+  double start = nowSeconds();
+  for (int i = 0; i < strings; i++) {
+    *sum += hash(data + (size_t)(i % span) * size, size);
+  }
+  return (double)strings * size / ((nowSeconds() - start) * 1e9);
+}
+
+int main(int argc, const char* argv[]) {
+  int capacity = 2 * 1024 * 1024;
+  char* data = (char*)malloc(capacity);
+  if (data == NULL) {
+    return 1;
+  }
+  srand(1);
+  for (int i = 0; i < capacity; i++) {
+    data[i] = (char)rand();
+  }
+
+  int failures = 0;
+  for (int length = 0; length <= 4096; length++) {
+    useHashPath(HASH_SCALAR);
+    uint32_t expected = hashBytes(data + 3, length);
+    for (int path = 0; path < HASH_PATHS; path++) {
+      if (useHashPath((HashPath)path) && (hashBytes(data + 3, length) != expected)) {
+        fprintf(stderr, "%s hash differs for %d bytes\n", hashPathName((HashPath)path), length);
+        failures++;
+      }
+    }
+  }
+
+  uint32_t sum = 0;
+  printf("%10s %8s", "bytes", "fnv1a");
+  for (int path = 0; path < HASH_PATHS; path++) {
+    if (hashPathSupported((HashPath)path)) {
+      printf(" %8s", hashPathName((HashPath)path));
+    }
+  }
+  printf("   (bytes/ns)\n");
+  for (int i = 0; sizes_[i] != 0; i++) {
+    printf("%10d %8.2f", sizes_[i], throughput(fnv1a, data, sizes_[i], &sum));
+    for (int path = 0; path < HASH_PATHS; path++) {
+      if (useHashPath((HashPath)path)) {
+        printf(" %8.2f", throughput(hashBytes, data, sizes_[i], &sum));
+      }
+    }
+    printf("\n");
+  }
+  printf("(checksum %u)\n", sum);
+
+  free(data);
+  return (failures == 0) ? 0 : 1;
+}
@@ -1,8 +1,17 @@
 #include <stdarg.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "../chunk.h"
+#include "../compact.h"
 #include "../config.h"
+#include "../hash.h"
+#include "../list.h"
+#include "../memory.h"
+#include "../native.h"
+#include "../table.h"
 #include "../vm.h"
 
 #include "runtests.h"
@@ -46,9 +55,832 @@ static void test_alwaysFail() {
   check(1 < 0, "This failed as it should.");
 }
 
+static void test_methodCacheHits() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "class A { m() { return 1; } }"
+    "var a = A();"
+    "for (var i = 0; i < 10; i = i + 1) { a.m(); }");
+  restorePrint();
+  check(result == INTERPRET_OK, "Method cache program failed.");
+  check((vm_.cacheHits == 9) && (vm_.cacheMisses == 1),
+        "Expected 9 cache hits and 1 miss but got %zu and %zu.",
+        vm_.cacheHits, vm_.cacheMisses);
+}
+
+static double globalNumber(const char* name) {
+  Value value;
+  tableGet(&vm_.globals, copyString(name, (int)strlen(name)), &value);
+  return AS_NUMBER(value);
+}
+
+static void test_globalCaches() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "var g = 1;"
+    "fun getG() { return g; }"
+    "fun setG(v) { g = v; }"
+    "var a = getG();"
+    "setG(2);"
+    "var b = getG();");
+  restorePrint();
+  check(result == INTERPRET_OK, "Global cache program failed.");
+
+  // Enough new globals to move g around the table and then resize it.
+  int capacity = vm_.globals.capacity;
+  quietPrint();
+  for (int batch = 0; batch < 200; batch += 50) {
+    char source[50 * 24];
+    int length = 0;
+    for (int i = batch; i < batch + 50; i++) {
+      length += sprintf(source + length, "var cached%d = %d;", i, i);
+    }
+    result = interpret(source);
+    check(result == INTERPRET_OK, "Defining globals failed.");
+  }
+  result = interpret(
+    "var c = getG();"
+    "setG(3);"
+    "var d = g;"
+    "var g = 4;"
+    "var e = getG();"
+    "setG(5);");
+  restorePrint();
+  check(result == INTERPRET_OK, "Global cache program failed after new globals.");
+  check(vm_.globals.capacity > capacity, "Expected the globals table to grow.");
+  check((globalNumber("a") == 1) && (globalNumber("b") == 2), "Expected the cache to see g.");
+  check(globalNumber("c") == 2, "Expected g to be 2 after new globals, not %g.", globalNumber("c"));
+  check(globalNumber("d") == 3, "Expected setG() to set g, not %g.", globalNumber("d"));
+  check(globalNumber("e") == 4, "Expected redefined g to be 4, not %g.", globalNumber("e"));
+  check(globalNumber("g") == 5, "Expected g to end as 5, not %g.", globalNumber("g"));
+  check(globalNumber("cached199") == 199, "Expected the new globals to keep their values.");
+}
+
+static void test_sharedShapes() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "class P { init(x, y) { this.x = x; this.y = y; } }"
+    "var a = P(1, 2);"
+    "var b = P(3, 4);");
+  restorePrint();
+  check(result == INTERPRET_OK, "Shape program failed.");
+  Value a;
+  Value b;
+  tableGet(&vm_.globals, copyString("a", 1), &a);
+  tableGet(&vm_.globals, copyString("b", 1), &b);
+  check(AS_INSTANCE(a)->shape == AS_INSTANCE(b)->shape,
+        "Instances with the same fields should share a shape.");
+  check(AS_INSTANCE(a)->shape->slotCount == 2,
+        "Expected 2 slots but got %d.", AS_INSTANCE(a)->shape->slotCount);
+}
+
+static void test_deepRecursion() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "fun depth(n) { if (n == 0) return 0; return 1 + depth(n - 1); }"
+    "var d = depth(1000);");
+  restorePrint();
+  check(result == INTERPRET_OK, "Deep recursion failed.");
+  check(vm_.current->stackCapacity > FIBER_STACK_MIN,
+        "Expected the fiber stack to grow.");
+}
+
+static void test_fiberValues() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "fun twice(x) { var y = yield(x * 2); return y * 2; }"
+    "var f = Fiber(twice);"
+    "var a = f.run(1);"
+    "var b = f.run(5);");
+  restorePrint();
+  check(result == INTERPRET_OK, "Fiber program failed.");
+  Value a;
+  Value b;
+  tableGet(&vm_.globals, copyString("a", 1), &a);
+  tableGet(&vm_.globals, copyString("b", 1), &b);
+  check(AS_NUMBER(a) == 2, "Expected yield to pass 2 but got %g.", AS_NUMBER(a));
+  check(AS_NUMBER(b) == 10, "Expected return to pass 10 but got %g.", AS_NUMBER(b));
+  check(vm_.current == vm_.root, "Expected to end on the root fiber.");
+
+  const char* misuses[] = {
+    "fun once() { return 1; } var f = Fiber(once); f.run(nil); f.run(nil);",
+    "var f; fun self() { return f.run(nil); } f = Fiber(self); f.run(nil);",
+    "_fiber_run_(1, nil);",
+    NULL
+  };
+  for (int i = 0; misuses[i] != NULL; i++) {
+    quietPrint();
+    result = interpret(misuses[i]);
+    restorePrint();
+    check(result == INTERPRET_RUNTIME_ERROR, "Expected an error from: %s", misuses[i]);
+  }
+}
+
+// What classify() in test_superinstructions() should give.
+static int classify(int a, int b) {
+  int m = (a > 3) ? a : -1;
+  int r = 0;
+  r += (a != b) ? 1 : 0;
+  r += (a >= b) ? 2 : 0;
+  r += (a <= b) ? 4 : 0;
+  r += (a < b) ? 8 : 0;
+  r += !(a > b) ? 16 : 0;
+  r += ((a < b) && (b != 0)) ? 32 : 0;
+  r += ((a >= b) || (b <= 0)) ? 64 : 0;
+  r += ((a != b) && ((a > 0) || (b < 0))) ? 128 : 0;
+  r += (((m > 3) ? m : b) < 4) ? 256 : 0;
+  int w = 0;
+  while ((w < a) && (w != 3)) {
+    w += 1;
+  }
+  return r + w * 512;
+}
+
+static void test_superinstructions() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "fun classify(a, b) {"
+    "  var m = nil;"
+    "  if (a > 3) m = a;"
+    "  var r = 0;"
+    "  if (a != b) r = r + 1;"
+    "  if (a >= b) r = r + 2;"
+    "  if (a <= b) r = r + 4;"
+    "  if (a < b) r = r + 8;"
+    "  if (not (a > b)) r = r + 16;"
+    "  if (a < b and b != 0) r = r + 32;"
+    "  if (a >= b or b <= 0) r = r + 64;"
+    "  if (not (a == b) and (a > 0 or b < 0)) r = r + 128;"
+    "  if ((m or b) < 4) r = r + 256;"
+    "  var w = 0;"
+    "  while (w < a and w != 3) w = w + 1;"
+    "  return r + w * 512;"
+    "}"
+    "var results = [];"
+    "for (var a = -2; a <= 6; a = a + 1) {"
+    "  for (var b = -2; b <= 6; b = b + 1) results.add(classify(a, b));"
+    "}");
+  restorePrint();
+  check(result == INTERPRET_OK, "Superinstruction program failed.");
+
+  Value classifier;
+  tableGet(&vm_.globals, copyString("classify", 8), &classifier);
+  Chunk* chunk = &AS_CLOSURE(classifier)->function->chunk;
+  bool fusedJump = false;
+  bool fusedAdd = false;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    fusedJump |= (chunk->code[offset] == OP_NOT_EQUAL_JUMP_IF_FALSE);
+    fusedAdd |= (chunk->code[offset] == OP_ADD_LOCAL_CONSTANT);
+  }
+  check(fusedJump && fusedAdd, "Expected classify() to use superinstructions.");
+
+  Value results;
+  tableGet(&vm_.globals, copyString("results", 7), &results);
+  ObjList* list = (ObjList*)AS_OBJ(AS_INSTANCE(results)->fields[0]);
+  check(list->values.count == 81, "Expected 81 results but got %d.", list->values.count);
+  int wrong = 0;
+  while ((wrong < list->values.count) &&
+         (AS_NUMBER(list->values.values[wrong]) == classify(wrong / 9 - 2, wrong % 9 - 2))) {
+    wrong++;
+  }
+  check(wrong == list->values.count, "Expected classify(%d, %d) to be %d.",
+        wrong / 9 - 2, wrong % 9 - 2, classify(wrong / 9 - 2, wrong % 9 - 2));
+}
+
+static void test_indexing() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "class Doubled < List { getAt(i) { return super.getAt(i) * 2; } }"
+    "class Logged < Table {"
+    "  init() { super.init(); this.sets = 0; }"
+    "  setAt(k, v) { this.sets = this.sets + 1; return super.setAt(k, v); }"
+    "}"
+    "var xs = [10, 20, 30];"
+    "xs[1] = xs[0] + xs[2];"
+    "xs[2.5] = 7;"
+    "var t = Table();"
+    "t[\"a\"] = 1; t[2] = \"two\"; t[nil] = true; t[\"a\"] = t[\"a\"] + 1;"
+    "var d = Doubled();"
+    "d.add(1); d.add(2); d[0] = 5;"
+    "var logged = Logged();"
+    "logged[1] = 1; logged[1] = logged[1] + 1;"
+    "var ok = (xs[0] == 10) and (xs[1] == 40) and (xs[2] == 7) and (xs[1.5] == 40)"
+    "  and (t[\"a\"] == 2) and (t[2] == \"two\") and (t[nil] == true) and (t[3] == nil)"
+    "  and (d[0] == 10) and (d[1] == 4)"
+    "  and (logged[1] == 2) and (logged.sets == 2);");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected indexing to work.");
+
+  const char* misuses[] = {
+    "[1, 2][2];",
+    "[1, 2][-1];",
+    "[1, 2][0/0];",
+    "[1, 2][\"a\"];",
+    "var l = [1, 2]; l[2] = 3;",
+    "var l = [1, 2]; l[-1] = 3;",
+    "var l = [1, 2]; l[nil] = 3;",
+    "Doubled()[0];",
+    NULL
+  };
+  for (int i = 0; misuses[i] != NULL; i++) {
+    quietPrint();
+    result = interpret(misuses[i]);
+    restorePrint();
+    check(result == INTERPRET_RUNTIME_ERROR, "Expected an error from: %s", misuses[i]);
+  }
+}
+
+static void test_writeBarrier() {
+  quietPrint();
+  InterpretResult result = interpret("var l = [];");
+  collectYoung();
+  result = interpret("l.add(\"x\" # 1);");
+  restorePrint();
+  check(result == INTERPRET_OK, "Write barrier program failed.");
+
+  Value l;
+  tableGet(&vm_.globals, copyString("l", 1), &l);
+  ObjList* list = (ObjList*)AS_OBJ(AS_INSTANCE(l)->fields[0]);
+  check(list->obj.isOld, "Expected the list to be promoted.");
+  check(list->obj.isRemembered, "Expected the list to be remembered.");
+  collectYoung();
+  check(AS_OBJ(list->values.values[0])->isOld,
+        "Expected the young list item to survive and be promoted.");
+}
+
+static void test_incrementalMarking() {
+  int stepObjects = config_.gc_step_objects;
+  config_.gc_step_objects = 1;
+  quietPrint();
+  InterpretResult result = interpret(
+    "class N { init(v, n) { this.v = v; this.n = n; } }"
+    "var h = nil;"
+    "for (var i = 0; i < 20000; i = i + 1) h = N(\"s\" # i, h);"
+    "var c = 0;"
+    "while (h != nil) { c = c + 1; h = h.n; }");
+  restorePrint();
+  config_.gc_step_objects = stepObjects;
+  check(result == INTERPRET_OK, "Incremental marking program failed.");
+
+  Value c;
+  tableGet(&vm_.globals, copyString("c", 1), &c);
+  check(AS_NUMBER(c) == 20000, "Expected 20000 nodes but found %g.", AS_NUMBER(c));
+  check(vm_.gcCycles > 0, "Expected a major collection to finish.");
+}
+
+static void test_slabPages() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "var l = [];"
+    "for (var i = 0; i < 5000; i = i + 1) l.add([i]);");
+  restorePrint();
+  check(result == INTERPRET_OK, "Slab program failed.");
+
+  int pages = vm_.slabs.pageCount;
+  quietPrint();
+  interpret("l = nil;");
+  restorePrint();
+  collectGarbage();
+  check(vm_.slabs.pageCount < pages,
+        "Expected empty slab pages to be released but still have %d of %d.",
+        vm_.slabs.pageCount, pages);
+}
+
+static void test_parallelMarking() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "class N { init(i) { this.l = [i, \"n\" # i]; this.t = {\"k\": i}; } }"
+    "var keep = [];"
+    "for (var i = 0; i < 3000; i = i + 1) { var n = N(i); if (i < 2000) keep.add(n); }");
+  restorePrint();
+  check(result == INTERPRET_OK, "Parallel marking program failed.");
+
+  // The serial collection that follows should find nothing more to free.
+  int threads = config_.gc_threads;
+  config_.gc_threads = 4;
+  collectGarbage();
+  config_.gc_threads = threads;
+  size_t parallel = vm_.bytesAllocated;
+  collectGarbage();
+  check(vm_.bytesAllocated == parallel,
+        "Expected parallel marking to keep %zu bytes but serial marking kept %zu.",
+        parallel, vm_.bytesAllocated);
+
+  quietPrint();
+  result = interpret(
+    "var sum = 0;"
+    "for (var i = 0; i < 2000; i = i + 1) sum = sum + keep[i].t[\"k\"];");
+  restorePrint();
+  Value sum;
+  tableGet(&vm_.globals, copyString("sum", 3), &sum);
+  check((result == INTERPRET_OK) && (AS_NUMBER(sum) == 1999000),
+        "Expected the kept objects to survive parallel marking.");
+}
+
+static void test_lazySweep() {
+  // Small steps leave pages unswept while the program makes the same
+  // strings again, finding garbage ones in the intern table.
+  int step = config_.gc_step_objects;
+  config_.gc_step_objects = 10;
+  quietPrint();
+  InterpretResult result = interpret(
+    "var pad = [];"
+    "for (var i = 0; i < 30000; i = i + 1) pad.add([i]);"
+    "var keep = [];"
+    "for (var r = 0; r < 40; r = r + 1)"
+    "  for (var i = 0; i < 1000; i = i + 1) { var s = \"s\" # i; if (r == 39) keep.add(s); }");
+  config_.gc_step_objects = step;
+  collectGarbage();
+  interpret(
+    "var found = 0;"
+    "for (var i = 0; i < 1000; i = i + 1) if (keep[i] == \"s\" # i) found = found + 1;");
+  restorePrint();
+
+  Value found;
+  tableGet(&vm_.globals, copyString("found", 5), &found);
+  check((result == INTERPRET_OK) && (AS_NUMBER(found) == 1000) && (vm_.gcCycles > 0),
+        "Expected the kept strings to survive the lazy sweep.");
+}
+
+static void test_markBitmaps() {
+  quietPrint();
+  InterpretResult result = interpret("var l = [1, \"a\"];");
+  restorePrint();
+  check(result == INTERPRET_OK, "Mark bitmap program failed.");
+
+  // Once old, a live object is not written to by a major collection.
+  Value list;
+  tableGet(&vm_.globals, copyString("l", 1), &list);
+  collectGarbage();
+  ObjList before = *AS_LIST(list);
+  collectGarbage();
+  check(memcmp(&before, AS_LIST(list), sizeof(ObjList)) == 0,
+        "Expected a major collection to leave an old list untouched.");
+  check(!slabIsMarked(AS_OBJ(list)), "Expected the mark bits to be cleared by the sweep.");
+}
+
+static void test_compaction() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "class P { init(x) { this.x = x; this.s = \"p\" # x; } }"
+    "fun counter(n) { fun inc() { n = n + 1; return n; } return inc; }"
+    "var all = [];"
+    "for (var i = 0; i < 20000; i = i + 1) all.add([P(i), counter(i), {\"k\": i}]);"
+    "var keep = [];"
+    "for (var i = 0; i < 20000; i = i + 10) keep.add(all[i]);"
+    "all = nil;");
+  restorePrint();
+  check(result == INTERPRET_OK, "Compaction program failed.");
+
+  collectGarbage();
+  int pages = vm_.slabs.pageCount;
+  compactHeap();
+  check((vm_.compactions == 1) && (vm_.slabs.pageCount < pages / 2),
+        "Expected compaction to release most of %d pages but %d are left.",
+        pages, vm_.slabs.pageCount);
+
+  quietPrint();
+  result = interpret(
+    "var sum = 0;"
+    "for (var i = 0; i < keep.len(); i = i + 1) {"
+    "  var e = keep[i];"
+    "  if (e[0].s == \"p\" # e[0].x) sum = sum + e[0].x + e[1]() + e[2][\"k\"];"
+    "}");
+  restorePrint();
+  Value sum;
+  tableGet(&vm_.globals, copyString("sum", 3), &sum);
+  check((result == INTERPRET_OK) && (AS_NUMBER(sum) == 59972000),
+        "Expected the moved objects to be intact.");
+
+  // Past the threshold, a collection has the heap compacted at the next
+  // loop iteration.
+  quietPrint();
+  interpret(
+    "var more = [];"
+    "for (var i = 0; i < 60000; i = i + 1) more.add(P(i));"
+    "var kept = [];"
+    "for (var i = 0; i < 60000; i = i + 20) kept.add(more[i]);"
+    "more = nil;");
+  int percent = config_.gc_compact_percent;
+  config_.gc_compact_percent = 10;
+  collectGarbage();
+  config_.gc_compact_percent = percent;
+  result = interpret(
+    "sum = 0;"
+    "for (var i = 0; i < kept.len(); i = i + 1) sum = sum + kept[i].x;");
+  restorePrint();
+  tableGet(&vm_.globals, copyString("sum", 3), &sum);
+  check((result == INTERPRET_OK) && (vm_.compactions == 2) && (AS_NUMBER(sum) == 89970000),
+        "Expected the fragmented heap to be compacted.");
+}
+
+static void test_gcHeuristics() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "var keep = [];"
+    "for (var i = 0; i < 20000; i = i + 1) keep.add(\"s\" # i);"
+    "for (var i = 0; i < 20000; i = i + 1) [i];");
+  restorePrint();
+  check(result == INTERPRET_OK, "Heuristics program failed.");
+
+  Config saved = config_;
+  config_.gc_growth_factor = 3;
+  collectGarbage();
+  check(vm_.nextGC == vm_.bytesAllocated * 3,
+        "Expected the next collection at 3 times %zu, not %zu.",
+        vm_.bytesAllocated, vm_.nextGC);
+  config_.gc_max_heap = vm_.bytesAllocated + 1024;
+  collectGarbage();
+  check(vm_.nextGC == config_.gc_max_heap, "Expected the heap size to be capped.");
+  config_ = saved;
+
+  quietPrint();
+  result = interpret(
+    "var stats = gcStats();"
+    "var ok = stats[\"collections\"] >= 2 and stats[\"bytesFreed\"] > 0"
+    "  and stats[\"live\"][\"string\"] >= 20000 * 16"
+    "  and stats[\"pauses\"] > 0 and stats[\"allocationRate\"] > 0;");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected gcStats() to count the collections.");
+}
+
+static void test_stringBuilder() {
+  int strings = vm_.strings.count;
+  quietPrint();
+  InterpretResult result = interpret(
+    "var b = StringBuilder();"
+    "for (var i = 0; i < 1000; i = i + 1) b.add(\"ab\").add(nil);"
+    "var s = #b;"
+    "var ok = (b.len() == 5000) and (s == #b) and (\"<\" # b # \">\" == \"<\" # s # \">\");");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected the builder to hold 1000 pieces.");
+  check(vm_.strings.count - strings < 100,
+        "Expected no intermediate strings to be interned, but %d were.",
+        vm_.strings.count - strings);
+}
+
+static void test_lazyInterning() {
+  int strings = vm_.strings.count;
+  quietPrint();
+  InterpretResult result = interpret(
+    "var p = \"0123456789012345678901234567890123456789\";"
+    "var ok = true;"
+    "for (var i = 0; i < 1000; i = i + 1) ok = ok and (p # p # p == p # (p # p));"
+    "var t = {};"
+    "t[p # p] = 1;"
+    "ok = ok and (t[p # p] == 1) and (t[p # p # \"x\"] == nil);");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok),
+        "Expected equal long strings to be equal, and to find the same key.");
+  check(vm_.strings.count - strings < 100,
+        "Expected long strings not to be interned, but %d were.",
+        vm_.strings.count - strings);
+
+  // A long string that stays uninterned keeps the hash of its first
+  // lookup.
+  char chars[STRING_INTERN_LIMIT + 10];
+  memset(chars, 'k', sizeof(chars));
+  ObjString* key = copyString(chars, sizeof(chars));
+  push(OBJ_VAL(key));
+  check(!key->isHashed, "Expected a long string not to be hashed when created.");
+  check(findString(key) == NULL, "Expected no interned copy of the long string.");
+  uint32_t hash = key->hash;
+  key->hash = hash ^ 1;
+  findString(key);
+  check(key->isHashed && (key->hash == (hash ^ 1)),
+        "Expected a long string to be hashed only once.");
+  key->hash = hash;
+  pop();
+}
+
+static void test_hashPaths() {
+  char data[1100];
+  for (int i = 0; i < (int)sizeof(data); i++) {
+    data[i] = (char)(i * 7 + i / 13);
+  }
+  HashPath chosen = currentHashPath();
+  int differences = 0;
+  for (int length = 0; length < 1090; length++) {
+    useHashPath(HASH_SCALAR);
+    uint32_t expected = hashBytes(data + 1, length);
+    for (int path = 0; path < HASH_PATHS; path++) {
+      if (useHashPath((HashPath)path) && (hashBytes(data + 1, length) != expected)) {
+        differences++;
+      }
+    }
+  }
+  useHashPath(chosen);
+  check(differences == 0, "Expected every hashing path to agree, but %d hashes differ.", differences);
+  check(hashBytes("abc", 3) != hashBytes("acb", 3), "Expected different hashes for permutations.");
+}
+
+static void test_tableChurn() {
+  Table table;
+  initTable(&table);
+  ObjString* keys[1000];
+  // The keys are kept alive by a global list, and found by interning.
+  quietPrint();
+  interpret("var keys = [];"
+            "for (var i = 0; i < 1000; i = i + 1) keys.add(\"key\" # i);");
+  restorePrint();
+  for (int i = 0; i < 1000; i++) {
+    char name[16];
+    int length = sprintf(name, "key%d", i);
+    keys[i] = copyString(name, length);
+  }
+
+  // Deleting leaves no tombstones, so the same keys going in and out
+  // never make the table grow.
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < 1000; i++) {
+      tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+    for (int i = 1; i < 1000; i += 2) {
+      tableDelete(&table, keys[i]);
+    }
+  }
+  int missing = 0;
+  for (int i = 0; i < 1000; i++) {
+    Value value;
+    bool found = tableGet(&table, keys[i], &value);
+    if (found != (i % 2 == 0) || (found && (AS_NUMBER(value) != i))) {
+      missing++;
+    }
+  }
+  check(missing == 0, "Expected only the even keys, but %d are wrong.", missing);
+  check(countTableLive(&table) == 500, "Expected 500 keys but counted %d.", countTableLive(&table));
+  check(table.capacity == 2048, "Expected the table to stay at 2048 entries, not %d.", table.capacity);
+  freeTable(&table);
+}
+
+static void test_valueKeys() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "class P {}"
+    "var t = {1: \"one\", true: \"yes\", nil: \"none\"};"
+    "t[0] = \"zero\";"
+    "t[0/0] = \"nan\";"
+    "var keys = [];"
+    "for (var i = 0; i < 3000; i = i + 1) {"
+    "  var p = P();"
+    "  P();"
+    "  if (i < 50) { t[p] = i; keys.add(p); }"
+    "}"
+    "gc(true);"
+    "var ok = (t[1] == \"one\") and (t[true] == \"yes\") and (t[nil] == \"none\")"
+    "  and (t[false] == nil) and (t[-0] == \"zero\") and (t[0/0] == \"nan\")"
+    "  and (t[P()] == nil) and (t.len() == 55);"
+    "for (var i = 0; i < 50; i = i + 1) if (t[keys[i]] != i) ok = false;");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected tables to find keys of every type.");
+}
+
+static void test_tableIteration() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "var t = {\"b\": 2, \"a\": 1, 3: \"c\"};"
+    "t.del(\"b\");"
+    "t[\"b\"] = 4;"
+    "var keys = \"\";"
+    "for (k in t) keys = keys # k;"
+    "var values = \"\";"
+    "for (v in t.values()) values = values # v;"
+    "var entries = \"\";"
+    "for (e in t.entries()) entries = entries # e[0] # e[1];"
+    "var ok = (keys == \"a3b\") and (values == \"1c4\") and (entries == \"a13cb4\")"
+    "  and (str(t) == \"{a: 1, 3: c, b: 4}\");");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected tables to iterate in insertion order.");
+
+  quietPrint();
+  result = interpret("var t = {1: 1, 2: 2}; for (k in t) t.del(k);");
+  restorePrint();
+  check(result == INTERPRET_RUNTIME_ERROR, "Expected deleting while iterating to fail.");
+
+  // Deleted entries are dropped when the entries fill up, rather than
+  // making the map grow.
+  Map map;
+  initMap(&map);
+  for (int i = 0; i < 100000; i++) {
+    mapSet(&map, NUMBER_VAL(i), NUMBER_VAL(i));
+    if (i >= 10) {
+      mapDelete(&map, NUMBER_VAL(i - 10));
+    }
+  }
+  check(map.count == 10, "Expected 10 keys but counted %d.", map.count);
+  check(map.slotCount <= 32, "Expected the map to stay small, not %d slots.", map.slotCount);
+  int position = mapLiveFrom(&map, 0);
+  check(AS_NUMBER(map.entries[position].key) == 99990, "Expected the oldest key first.");
+  freeMap(&map);
+}
+
+static void test_forIn() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "var sum = 0;"
+    "for (x in [1, 2, 3]) sum = sum + x;"
+    "for (i in range(10, 0, -3)) sum = sum + i;"
+    "class Countdown {"
+    "  init(n) { this.n = n; }"
+    "  iter() { return this; }"
+    "  done() { return this.n == 0; }"
+    "  next() { this.n = this.n - 1; return this.n + 1; }"
+    "}"
+    "for (c in Countdown(4)) sum = sum + c;"
+    "class Evens < List {"
+    "  iter() { return Countdown(2); }"
+    "}"
+    "var evens = Evens();"
+    "evens.add(100);"
+    "for (e in evens) sum = sum + e;"
+    "var ok = (sum == 6 + 22 + 10 + 3);");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected for-in to walk lists, ranges and iterators.");
+
+  quietPrint();
+  result = interpret("for (x in 5) print(x);");
+  restorePrint();
+  check(result == INTERPRET_RUNTIME_ERROR, "Expected iterating a number to fail.");
+}
+
+static void test_longRange() {
+  quietPrint();
+  InterpretResult result = interpret("var walk = range(0, 10000000000, 0.5).iter();");
+  restorePrint();
+  check(result == INTERPRET_OK, "Long range program failed.");
+
+  // Skip ahead rather than walk more than INT_MAX steps.
+  Value walk;
+  tableGet(&vm_.globals, copyString("walk", 4), &walk);
+  ObjIterator* iterator = AS_ITERATOR(AS_INSTANCE(walk)->fields[0]);
+  iterator->position = INT_MAX;
+  Value first = NIL_VAL;
+  Value second = NIL_VAL;
+  bool more = iteratorNext(iterator, &first) && iteratorNext(iterator, &second);
+  check(more && (AS_NUMBER(first) == INT_MAX * 0.5) &&
+        (AS_NUMBER(second) == (INT_MAX + 1.0) * 0.5),
+        "Expected a range to carry on past INT_MAX steps.");
+  iterator->position = 20000000000;
+  check(!iteratorNext(iterator, &first), "Expected a long range to end.");
+}
+
+static void test_listOperations() {
+  quietPrint();
+  InterpretResult result = interpret(
+    "fun square(x) { return x * x; }"
+    "fun big(x) { return x > 2; }"
+    "fun add(total, x) { return total + x; }"
+    "fun byFirst(a, b) { return a[0] < b[0]; }"
+    "var xs = [3, 1, 2, 4];"
+    "xs.sort();"
+    "var ys = xs.slice(1, -1);"
+    "ys.extend(ys);"
+    "ys.reverse();"
+    "var pairs = [[2, \"a\"], [1, \"b\"], [2, \"c\"], [1, \"d\"]];"
+    "pairs.sortBy(byFirst);"
+    "var order = \"\";"
+    "for (p in pairs) order = order # p[1];"
+    "var ok = (str(xs) == \"[1, 2, 3, 4]\") and (str(ys) == \"[3, 2, 3, 2]\")"
+    "  and (str(xs.map(square)) == \"[1, 4, 9, 16]\")"
+    "  and (str(xs.filter(big)) == \"[3, 4]\") and (xs.reduce(add, 10) == 20)"
+    "  and (xs.indexOf(3) == 2) and (xs.indexOf(5) == -1) and (order == \"bdac\");");
+  restorePrint();
+  Value ok;
+  tableGet(&vm_.globals, copyString("ok", 2), &ok);
+  check((result == INTERPRET_OK) && AS_BOOL(ok), "Expected the list operations to work.");
+
+  // Objects move when a comparison compacts the heap.
+  quietPrint();
+  result = interpret(
+    "class P { init(x) { this.x = x; } }"
+    "var junk = [];"
+    "for (var i = 0; i < 20000; i = i + 1) junk.add([P(i), \"s\" # i]);"
+    "var items = [];"
+    "for (var i = 0; i < 300; i = i + 1) items.add(P(300 - i));"
+    "junk = nil;"
+    "var calls = 0;"
+    "fun before(a, b) {"
+    "  calls = calls + 1;"
+    "  if (calls == 5) gc(true);"
+    "  return a.x < b.x;"
+    "}"
+    "items.sortBy(before);"
+    "var sorted = true;"
+    "for (var i = 0; i < items.len(); i = i + 1) if (items[i].x != i + 1) sorted = false;");
+  restorePrint();
+  Value sorted;
+  tableGet(&vm_.globals, copyString("sorted", 6), &sorted);
+  check((result == INTERPRET_OK) && AS_BOOL(sorted) && (vm_.compactions > 0),
+        "Expected sorting to survive compaction.");
+
+  quietPrint();
+  result = interpret("fun bad(x) { return x + nil; } [1, 2].map(bad);");
+  restorePrint();
+  check(result == INTERPRET_RUNTIME_ERROR, "Expected an error in a callback to fail the call.");
+
+  const char* misuses[] = {
+    "[1, 2, 3].slice(0/0, 2);",
+    "[1, 2, 3].slice(0, 0/0);",
+    "[1, 2, 3].slice(\"a\", 2);",
+    "[1, 2, 3].slice(0, nil);",
+    "var t = Table(); for (var i = 0; i < 50; i = i + 1) t[i] = i; [1].extend(t);",
+    NULL
+  };
+  for (int i = 0; misuses[i] != NULL; i++) {
+    quietPrint();
+    result = interpret(misuses[i]);
+    restorePrint();
+    check(result == INTERPRET_RUNTIME_ERROR, "Expected an error from: %s", misuses[i]);
+  }
+}
+
+static void test_listEnds() {
+  ObjList* list = newCoreList();
+  push(OBJ_VAL(list));
+
+  // A list used as a queue keeps reusing its array.
+  for (int i = 0; i < 100000; i++) {
+    listAppend(list, NUMBER_VAL(i));
+    if (i >= 10) {
+      listRemove(list, 0);
+    }
+  }
+  check(list->values.count == 10, "Expected 10 items but counted %d.", list->values.count);
+  check(list->front + list->values.capacity <= 32,
+        "Expected the queue to stay small, not %d slots.", list->front + list->values.capacity);
+  check(AS_NUMBER(list->values.values[0]) == 99990, "Expected the oldest item first.");
+
+  // Items added and removed anywhere stay in order.
+  freeListItems(list);
+  int model[1000];
+  int count = 0;
+  unsigned int seed = 1;
+  bool same = true;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    int index = (count == 0) ? 0 : (int)((seed >> 8) % (count + 1));
+    if ((count < 1000) && ((count < 10) || ((seed >> 4) & 1))) {
+      memmove(&model[index + 1], &model[index], (count - index) * sizeof(int));
+      model[index] = i;
+      count++;
+      listInsert(list, index, NUMBER_VAL(i));
+    }
+    else {
+      index = (index == count) ? index - 1 : index;
+      memmove(&model[index], &model[index + 1], (count - index - 1) * sizeof(int));
+      count--;
+      listRemove(list, index);
+    }
+    for (int j = 0; same && (j < count); j++) {
+      same = (list->values.count == count) && (AS_NUMBER(list->values.values[j]) == model[j]);
+    }
+  }
+  check(same, "Expected inserting and removing to keep the items in order.");
+  pop();
+}
+
 static TestFn tests[] = {
   test_alwaysSucceed,
   test_alwaysFail,
+  test_methodCacheHits,
+  test_globalCaches,
+  test_sharedShapes,
+  test_deepRecursion,
+  test_fiberValues,
+  test_superinstructions,
+  test_indexing,
+  test_writeBarrier,
+  test_incrementalMarking,
+  test_slabPages,
+  test_parallelMarking,
+  test_lazySweep,
+  test_markBitmaps,
+  test_compaction,
+  test_gcHeuristics,
+  test_stringBuilder,
+  test_lazyInterning,
+  test_hashPaths,
+  test_tableChurn,
+  test_valueKeys,
+  test_tableIteration,
+  test_forIn,
+  test_longRange,
+  test_listOperations,
+  test_listEnds,
   NULL
 };
 
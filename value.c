@@ -49,12 +49,24 @@ void reverseValueArray(ValueArray* array) {
   }
 }
 
+// Interned strings are equal only if they are the same object. Others
+// may have equal copies.
+static bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a->isInterned && b->isInterned) {
+    return false;
+  }
+  return (a->length == b->length) && (memcmp(a->chars, b->chars, a->length) == 0);
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b) {
+    return true;
+  }
+  return IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b));
 #else
   if (a.type != b.type) {
     return false;
@@ -63,7 +75,9 @@ bool valuesEqual(Value a, Value b) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      return (AS_OBJ(a) == AS_OBJ(b)) ||
+        (IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b)));
     default:         return false; // Unreachable.
   }
 #endif
@@ -87,6 +87,10 @@ typedef struct {
   Value* values;
 } ValueArray;
 
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
 bool valuesEqual(Value a, Value b);
 void printValue(Value value);
 void initValueArray(ValueArray* array);
@@ -3,19 +3,26 @@
 #include <string.h>
 
 #include "common.h"
+#include "compact.h"
 #include "compiler.h"
 #include "config.h"
 #include "constants.h"
 #include "core.loon.h"
 #include "debug.h"
+#include "list.h"
 #include "memory.h"
 #include "native.h"
 #include "object.h"
+#include "shape.h"
 #include "string.h"
 #include "vm.h"
 
 VM vm_;
 
+// The error of a native whose callback failed, which has been reported
+// already.
+static const char callbackFailed_[] = "callback failed";
+
 static void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
@@ -36,7 +43,22 @@ static void runtimeError(const char* format, ...) {
     }
   }
 
+  // Abandon every other fiber and start over on the root fiber.
   resetStack(vm_.current);
+  vm_.current = vm_.root;
+  resetStack(vm_.root);
+  vm_.readyHead = NULL;
+  vm_.readyTail = NULL;
+}
+
+static ObjClosure* coreMethod(Value className, Value methodName) {
+  Value klass;
+  Value method;
+  if (!tableGet(&vm_.globals, AS_STRING(className), &klass) ||
+      !tableGet(&AS_CLASS(klass)->methods, AS_STRING(methodName), &method)) {
+    return NULL;
+  }
+  return AS_CLOSURE(method);
 }
 
 static void initLibrary() {
@@ -46,21 +68,66 @@ static void initLibrary() {
   terminatedCore[core_loon_len] = '\0';
   interpret(terminatedCore);
   restorePrint();
+
+  vm_.listGetAt = coreMethod(strListClass_, strGetAt_);
+  vm_.listSetAt = coreMethod(strListClass_, strSetAt_);
+  vm_.tableGetAt = coreMethod(strTableClass_, strGetAt_);
+  vm_.tableSetAt = coreMethod(strTableClass_, strSetAt_);
+  vm_.listIter = coreMethod(strListClass_, strIter_);
+  vm_.tableIter = coreMethod(strTableClass_, strIter_);
+  vm_.rangeIter = coreMethod(strRangeClass_, strIter_);
+  vm_.iteratorIter = coreMethod(strIteratorClass_, strIter_);
 }
 
 void initVM() {
-  vm_.current = newFiber(NULL);
-  resetStack(vm_.current);
-  vm_.objects = NULL;
+  vm_.current = NULL;
+  vm_.root = NULL;
+  vm_.readyHead = NULL;
+  vm_.readyTail = NULL;
+  initSlabs(&vm_.slabs, sweepPage);
+  vm_.collectingYoung = false;
+  vm_.gcState = GC_IDLE;
+  vm_.gcCycles = 0;
+  vm_.compactPending = false;
+  vm_.compactions = 0;
+  vm_.sweepClass = 0;
+  vm_.sweepPage = NULL;
+  memset(&vm_.pauses, 0, sizeof(PauseHistogram));
+  memset(&vm_.gcStats, 0, sizeof(GcStats));
+  vm_.gcStats.startMicros = nowMicros();
+  vm_.markMicros = 0;
+  vm_.sweepMicros = 0;
   vm_.bytesAllocated = 0;
-  vm_.nextGC = 1024 * 1024;
+  vm_.nextGC = config_.gc_initial_heap;
+  vm_.nextYoungGC = GC_NURSERY_BYTES;
 
   vm_.grayCount = 0;
   vm_.grayCapacity = 0;
   vm_.grayStack = NULL;
+  vm_.rememberedCount = 0;
+  vm_.rememberedCapacity = 0;
+  vm_.remembered = NULL;
+
+  vm_.cacheHits = 0;
+  vm_.cacheMisses = 0;
+  vm_.nativeError = NULL;
+  vm_.callbackBase = 0;
 
   initTable(&vm_.globals);
   initTable(&vm_.strings);
+  vm_.emptyShape = NULL;
+  vm_.listGetAt = NULL;
+  vm_.listSetAt = NULL;
+  vm_.tableGetAt = NULL;
+  vm_.tableSetAt = NULL;
+  vm_.listIter = NULL;
+  vm_.tableIter = NULL;
+  vm_.rangeIter = NULL;
+  vm_.iteratorIter = NULL;
+
+  vm_.current = newFiber(NULL);
+  vm_.root = vm_.current;
+  vm_.emptyShape = newShape(NULL, NULL);
 
   initConstants();
   initNative();
@@ -87,21 +154,64 @@ static Value peek(int distance) {
   return vm_.current->stackTop[-1 - distance];
 }
 
+// Grow a fiber's value stack to hold at least 'needed' values, moving
+// every pointer into it. Natives that call back into the VM must re-read
+// their arguments afterwards, since the stack may have moved.
+static void ensureStack(ObjFiber* fiber, int needed) {
+  if (needed <= fiber->stackCapacity) {
+    return;
+  }
+
+  int oldCapacity = fiber->stackCapacity;
+  int capacity = oldCapacity;
+  while (capacity < needed) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+
+  Value* oldStack = fiber->stack;
+  fiber->stack = GROW_ARRAY(Value, fiber->stack, oldCapacity, capacity);
+  fiber->stackCapacity = capacity;
+  if (fiber->stack == oldStack) {
+    return;
+  }
+
+  fiber->stackTop = fiber->stack + (fiber->stackTop - oldStack);
+  for (int i = 0; i < fiber->frameCount; i++) {
+    fiber->frames[i].slots = fiber->stack + (fiber->frames[i].slots - oldStack);
+  }
+  for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = fiber->stack + (upvalue->location - oldStack);
+  }
+}
+
 static bool call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
     return false;
   }
 
-  if (vm_.current->frameCount == FRAMES_MAX) {
+  ObjFiber* fiber = vm_.current;
+  if (fiber->frameCount >= config_.max_depth) {
     runtimeError("Stack overflow.");
     return false;
   }
+  if (fiber->frameCount == fiber->frameCapacity) {
+    int oldCapacity = fiber->frameCapacity;
+    fiber->frameCapacity = GROW_CAPACITY(oldCapacity);
+    if (fiber->frameCapacity > config_.max_depth) {
+      fiber->frameCapacity = config_.max_depth;
+    }
+    fiber->frames = GROW_ARRAY(CallFrame, fiber->frames, oldCapacity, fiber->frameCapacity);
+  }
+
+  // A frame never uses more than BYTE_HEIGHT slots.
+  int slots = (int)(fiber->stackTop - fiber->stack) - argCount - 1;
+  ensureStack(fiber, slots + BYTE_HEIGHT);
 
-  CallFrame* frame = &vm_.current->frames[vm_.current->frameCount++];
+  CallFrame* frame = &fiber->frames[fiber->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm_.current->stackTop - argCount - 1;
+  frame->slots = fiber->stack + slots;
   return true;
 }
 
@@ -129,10 +239,22 @@ static bool callValue(Value callee, int argCount) {
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE: {
+        // If the native switched fibers, this fiber gets its result when
+        // it is resumed.
         NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm_.current->stackTop - argCount);
-        vm_.current->stackTop -= argCount + 1;
-        push(result);
+        ObjFiber* fiber = vm_.current;
+        Value result = native(argCount, fiber->stackTop - argCount);
+        if (vm_.nativeError != NULL) {
+          if (vm_.nativeError != callbackFailed_) {
+            runtimeError("%s", vm_.nativeError);
+          }
+          vm_.nativeError = NULL;
+          return false;
+        }
+        fiber->stackTop -= argCount + 1;
+        if (vm_.current == fiber) {
+          push(result);
+        }
         return true;
       }
       default:
@@ -170,7 +292,7 @@ static bool invoke(ObjString* name, int argCount) {
   ObjInstance* instance = AS_INSTANCE(receiver);
 
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  if (instanceGetField(instance, name, &value)) {
     vm_.current->stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
@@ -191,6 +313,352 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
   return true;
 }
 
+// Find a method through an inline cache, counting the hit or miss.
+static inline Value* findCachedMethod(InlineCache* cache, ObjClass* klass) {
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if ((entry->key == (Obj*)klass) && (entry->version == klass->methods.version)) {
+      vm_.cacheHits++;
+      return entry->slot;
+    }
+  }
+  vm_.cacheMisses++;
+  return NULL;
+}
+
+// Add an entry to an inline cache, evicting the oldest entry.
+static CacheEntry* addCacheEntry(InlineCache* cache, Obj* key) {
+  memmove(&cache->entries[1], &cache->entries[0], sizeof(CacheEntry) * (CACHE_WAYS - 1));
+  cache->entries[0].key = key;
+  cache->entries[0].version = 0;
+  cache->entries[0].index = -1;
+  cache->entries[0].slot = NULL;
+  return &cache->entries[0];
+}
+
+// Remember where a class keeps a method, returning the method's slot.
+static Value* fillMethodCache(InlineCache* cache, ObjClass* klass, ObjString* name) {
+  if (klass->fieldShadowsMethod) {
+    return NULL;
+  }
+  Value* slot = tableGetSlot(&klass->methods, name);
+  if (slot == NULL) {
+    return NULL;
+  }
+  CacheEntry* entry = addCacheEntry(cache, (Obj*)klass);
+  entry->version = klass->methods.version;
+  entry->slot = slot;
+  return slot;
+}
+
+// Find the slot of a field through an inline cache, or -1.
+static inline int findCachedField(InlineCache* cache, ObjInstance* instance) {
+  if (instance->shape == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    if (cache->entries[i].key == (Obj*)instance->shape) {
+      vm_.cacheHits++;
+      return cache->entries[i].index;
+    }
+  }
+  return -1;
+}
+
+// Remember which slot holds a field in instances with this one's shape.
+static void fillFieldCache(InlineCache* cache, ObjInstance* instance, ObjString* name) {
+  int slot = instanceFieldSlot(instance, name);
+  if (slot != -1) {
+    addCacheEntry(cache, (Obj*)instance->shape)->index = slot;
+  }
+}
+
+static bool getFieldCached(InlineCache* cache, ObjInstance* instance,
+                           ObjString* name, Value* value) {
+  if (!instanceGetField(instance, name, value)) {
+    return false;
+  }
+  vm_.cacheMisses++;
+  fillFieldCache(cache, instance, name);
+  return true;
+}
+
+static bool invokeCached(InlineCache* cache, ObjString* name, int argCount) {
+  Value receiver = peek(argCount);
+  if (IS_INSTANCE(receiver)) {
+    ObjClass* klass = AS_INSTANCE(receiver)->klass;
+    Value* method = findCachedMethod(cache, klass);
+    if (method != NULL) {
+      return call(AS_CLOSURE(*method), argCount);
+    }
+    fillMethodCache(cache, klass, name);
+  }
+  return invoke(name, argCount);
+}
+
+// Underlying list or table of a List or Table instance whose class
+// still uses 'core' for the method invoked through the cache, or NULL.
+static Obj* coreIndexData(InlineCache* cache, ObjString* name,
+                          Value receiver, ObjClosure* listCore, ObjClosure* tableCore) {
+  if (!IS_INSTANCE(receiver)) {
+    return NULL;
+  }
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  Value* method = findCachedMethod(cache, instance->klass);
+  if (method == NULL) {
+    method = fillMethodCache(cache, instance->klass, name);
+  }
+  if (method == NULL) {
+    return NULL;
+  }
+
+  ObjClosure* closure = AS_CLOSURE(*method);
+  Value data;
+  if (((closure != listCore) && (closure != tableCore)) ||
+      !instanceGetField(instance, AS_STRING(strData_), &data)) {
+    return NULL;
+  }
+  if ((closure == listCore) ? IS_LIST(data) : IS_TABLE(data)) {
+    return AS_OBJ(data);
+  }
+  return NULL;
+}
+
+static inline bool isListIndex(ObjList* list, Value index) {
+  return IS_NUMBER(index) && (AS_NUMBER(index) >= 0) &&
+    (AS_NUMBER(index) < list->values.count);
+}
+
+// Index a built-in List or Table without calling its getAt method.
+// Returns false if the receiver or index needs the method invoked.
+static bool indexGetCore(InlineCache* cache, ObjString* name,
+                         Value receiver, Value index, Value* value) {
+  Obj* data = coreIndexData(cache, name, receiver, vm_.listGetAt, vm_.tableGetAt);
+  if (data == NULL) {
+    return false;
+  }
+
+  if (data->type == OBJ_LIST) {
+    ObjList* list = (ObjList*)data;
+    if (!isListIndex(list, index)) {
+      return false;
+    }
+    *value = list->values.values[(int)AS_NUMBER(index)];
+    return true;
+  }
+
+  if (!mapGet(&((ObjTable*)data)->values, index, value)) {
+    *value = NIL_VAL;
+  }
+  return true;
+}
+
+// Store into a built-in List or Table without calling its setAt method.
+// The index and value must be reachable, since storing into a table may
+// allocate.
+static bool indexSetCore(InlineCache* cache, ObjString* name,
+                         Value receiver, Value index, Value value) {
+  Obj* data = coreIndexData(cache, name, receiver, vm_.listSetAt, vm_.tableSetAt);
+  if (data == NULL) {
+    return false;
+  }
+
+  if (data->type == OBJ_LIST) {
+    ObjList* list = (ObjList*)data;
+    if (!isListIndex(list, index)) {
+      return false;
+    }
+    list->values.values[(int)AS_NUMBER(index)] = value;
+    writeBarrier(data, value);
+    return true;
+  }
+
+  Value key = mapKey(index);
+  mapSet(&((ObjTable*)data)->values, key, value);
+  writeBarrierMapEntry(data, key, value);
+  return true;
+}
+
+// Underlying object of an instance whose iter() is 'core', as long as it
+// is of the given type, or NULL.
+static Obj* coreIterData(ObjInstance* instance, ObjClosure* core, ObjType type) {
+  Value method;
+  Value data;
+  if ((core == NULL) ||
+      !tableGet(&instance->klass->methods, AS_STRING(strIter_), &method) ||
+      (AS_CLOSURE(method) != core) ||
+      instanceGetField(instance, AS_STRING(strIter_), &method) ||
+      !instanceGetField(instance, AS_STRING(strData_), &data) ||
+      !isObjType(data, type)) {
+    return NULL;
+  }
+  return AS_OBJ(data);
+}
+
+// The native iterator of a built-in Iterator, or NULL.
+static ObjIterator* unwrapIterator(Value value) {
+  if (!IS_INSTANCE(value)) {
+    return NULL;
+  }
+  return (ObjIterator*)coreIterData(AS_INSTANCE(value), vm_.iteratorIter, OBJ_ITERATOR);
+}
+
+// A native iterator through a built-in List, Table or Range, or that of a
+// built-in Iterator, as long as its class still uses the core iter()
+// method. Returns NULL if iter() must be invoked. The value must be
+// reachable, since making an iterator allocates.
+static ObjIterator* coreIterator(Value value) {
+  if (!IS_INSTANCE(value)) {
+    return NULL;
+  }
+  ObjInstance* instance = AS_INSTANCE(value);
+  Obj* data;
+  if ((data = coreIterData(instance, vm_.listIter, OBJ_LIST)) != NULL) {
+    return newCoreIterator(data, ITERATE_LIST);
+  }
+  if ((data = coreIterData(instance, vm_.tableIter, OBJ_TABLE)) != NULL) {
+    return newCoreIterator(data, ITERATE_KEYS);
+  }
+  if ((data = coreIterData(instance, vm_.rangeIter, OBJ_RANGE)) != NULL) {
+    return newCoreIterator(data, ITERATE_RANGE);
+  }
+  return unwrapIterator(value);
+}
+
+static bool bindMethodCached(InlineCache* cache, ObjClass* klass, ObjString* name) {
+  Value* method = findCachedMethod(cache, klass);
+  if (method == NULL) {
+    fillMethodCache(cache, klass, name);
+    return bindMethod(klass, name);
+  }
+
+  ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(*method));
+  pop();
+  push(OBJ_VAL(bound));
+  return true;
+}
+
+// Method caches skip the receiver's fields, so once any instance has a
+// field with the same name as one of its class's methods, the class's
+// caches are invalidated and not refilled.
+static void setField(ObjInstance* instance, ObjString* name, Value value) {
+  if (instanceSetField(instance, name, value)) {
+    ObjClass* klass = instance->klass;
+    if (!klass->fieldShadowsMethod && (tableGetSlot(&klass->methods, name) != NULL)) {
+      klass->fieldShadowsMethod = true;
+      klass->methods.version++;
+    }
+  }
+}
+
+static void setFieldCached(InlineCache* cache, ObjInstance* instance,
+                           ObjString* name, Value value) {
+  vm_.cacheMisses++;
+  setField(instance, name, value);
+  fillFieldCache(cache, instance, name);
+}
+
+// Make 'fiber' current, passing it 'value' as the result of the run() or
+// yield() that suspended it, or as its function's argument if new.
+static void switchFiber(ObjFiber* fiber, Value value) {
+  vm_.current = fiber;
+  if (fiber->state == FIBER_NEW) {
+    ObjClosure* closure = AS_CLOSURE(fiber->stack[0]);
+    int arity = closure->function->arity;
+    for (int i = 0; i < arity; i++) {
+      push((i == 0) ? value : NIL_VAL);
+    }
+    call(closure, arity);
+  }
+  else {
+    push(value);
+  }
+  fiber->state = FIBER_RUNNING;
+}
+
+static ObjFiber* dequeueFiber() {
+  ObjFiber* fiber = vm_.readyHead;
+  if (fiber != NULL) {
+    vm_.readyHead = fiber->next;
+    if (vm_.readyHead == NULL) {
+      vm_.readyTail = NULL;
+    }
+    fiber->next = NULL;
+  }
+  return fiber;
+}
+
+static bool isReady(ObjFiber* fiber) {
+  return (fiber->next != NULL) || (vm_.readyTail == fiber);
+}
+
+// Queue a new or suspended fiber to run when the current one yields or
+// finishes.
+void spawnFiber(ObjFiber* fiber) {
+  if (isReady(fiber)) {
+    return;
+  }
+  if (vm_.readyTail == NULL) {
+    vm_.readyHead = fiber;
+  }
+  else {
+    vm_.readyTail->next = fiber;
+  }
+  vm_.readyTail = fiber;
+}
+
+// Run a new or suspended fiber from the current one, which waits for it
+// to yield or finish. Returns false if the fiber cannot be run, including
+// when it is in the ready queue.
+bool resumeFiber(ObjFiber* fiber, Value value) {
+  if (((fiber->state != FIBER_NEW) && (fiber->state != FIBER_SUSPENDED)) || isReady(fiber)) {
+    return false;
+  }
+  fiber->caller = vm_.current;
+  switchFiber(fiber, value);
+  return true;
+}
+
+// Suspend the current fiber. A fiber that was run by another one passes
+// 'value' back to it; otherwise the fiber goes to the back of the ready
+// queue, unless nothing else is ready to run.
+void yieldFiber(Value value) {
+  ObjFiber* fiber = vm_.current;
+  ObjFiber* caller = fiber->caller;
+  if (caller != NULL) {
+    fiber->caller = NULL;
+    fiber->state = FIBER_SUSPENDED;
+    switchFiber(caller, value);
+  }
+  else if (vm_.readyHead != NULL) {
+    fiber->state = FIBER_SUSPENDED;
+    spawnFiber(fiber);
+    switchFiber(dequeueFiber(), NIL_VAL);
+  }
+}
+
+// Called when the current fiber's function returns 'result'. Switches to
+// the fiber that runs next, or returns false once the script and every
+// spawned fiber have finished.
+static bool finishFiber(Value result) {
+  ObjFiber* fiber = vm_.current;
+  fiber->state = FIBER_DONE;
+  if (fiber->caller != NULL) {
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    switchFiber(caller, result);
+    return true;
+  }
+
+  ObjFiber* next = dequeueFiber();
+  if (next != NULL) {
+    switchFiber(next, NIL_VAL);
+    return true;
+  }
+  vm_.current = vm_.root;
+  return false;
+}
+
 static ObjUpvalue* captureUpvalue(Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
   ObjUpvalue* upvalue = vm_.current->openUpvalues;
@@ -220,6 +688,7 @@ static void closeUpvalues(Value* last) {
   while ((vm_.current->openUpvalues != NULL) && (vm_.current->openUpvalues->location >= last)) {
     ObjUpvalue* upvalue = vm_.current->openUpvalues;
     upvalue->closed = *upvalue->location;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
     upvalue->location = &upvalue->closed;
     vm_.current->openUpvalues = upvalue->next;
   }
@@ -229,32 +698,55 @@ static void defineMethod(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  writeBarrierEntry((Obj*)klass, name, method);
   pop();
 }
 
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+// Point a global variable's inline cache at the variable's current slot.
+static bool fillGlobalCache(CacheEntry* cache, ObjString* name) {
+  cache->slot = tableGetSlot(&vm_.globals, name);
+  if (cache->slot == NULL) {
+    return false;
+  }
+  cache->version = vm_.globals.version;
+  return true;
+}
+
+// Make the native being called fail with a runtime error once it returns.
+Value nativeError(const char* message) {
+  vm_.nativeError = message;
+  return NIL_VAL;
 }
 
-static inline Byte readByte(CallFrame** framePtr) {
-  return *(*framePtr)->ip++;
+ObjInstance* newCoreInstance(Value className, Obj* data) {
+  Value klass;
+  if (!tableGet(&vm_.globals, AS_STRING(className), &klass)) {
+    return NULL;
+  }
+
+  ObjInstance* instance = newInstance(AS_CLASS(klass));
+  push(OBJ_VAL(instance));
+  setField(instance, AS_STRING(strData_), OBJ_VAL(data));
+  pop();
+  return instance;
 }
 
 static InterpretResult createCoreList(int numValues) {
   ObjList* list = newCoreList();
+  push(OBJ_VAL(list));
+  Value* items = vm_.current->stackTop - numValues - 1;
   for (int i=0; i<numValues; ++i) {
-    writeValueArray(&list->values, pop());
+    listAppend(list, items[i]);
+    writeBarrier((Obj*)list, items[i]);
   }
-  reverseValueArray(&list->values);
 
-  Value klass;
-  if (!tableGet(&vm_.globals, AS_STRING(strListClass_), &klass)) {
+  ObjInstance* instance = newCoreInstance(strListClass_, (Obj*)list);
+  if (instance == NULL) {
     runtimeError("Cannot find definition of List class.");
     return INTERPRET_RUNTIME_ERROR;
   }
 
-  ObjInstance* instance = newInstance(AS_CLASS(klass));
-  tableSet(&instance->fields, AS_STRING(strData_), OBJ_VAL(list));
+  vm_.current->stackTop -= numValues + 1;
   push(OBJ_VAL(instance));
 
   return INTERPRET_OK;
@@ -262,386 +754,70 @@ static InterpretResult createCoreList(int numValues) {
 
 static InterpretResult createCoreTable(int numValues) {
   ObjTable* table = newCoreTable();
+  push(OBJ_VAL(table));
+  Value* items = vm_.current->stackTop - 2 * numValues - 1;
   for (int i=0; i<numValues; i++) {
-    Value value = pop();
-    Value key = pop();
-    if (!IS_STRING(key)) {
-      runtimeError("Table keys must be strings.");
-      return INTERPRET_RUNTIME_ERROR;
-    }
-    tableSet(&table->values, AS_STRING(key), value);
+    Value key = mapKey(items[2 * i]);
+    Value value = items[2 * i + 1];
+    mapSet(&table->values, key, value);
+    writeBarrierMapEntry((Obj*)table, key, value);
   }
 
-  Value klass;
-  if (!tableGet(&vm_.globals, AS_STRING(strTableClass_), &klass)) {
+  ObjInstance* instance = newCoreInstance(strTableClass_, (Obj*)table);
+  if (instance == NULL) {
     runtimeError("Cannot find definition of Table class.");
     return INTERPRET_RUNTIME_ERROR;
   }
 
-  ObjInstance* instance = newInstance(AS_CLASS(klass));
-  tableSet(&instance->fields, AS_STRING(strData_), OBJ_VAL(table));
+  vm_.current->stackTop -= 2 * numValues + 1;
   push(OBJ_VAL(instance));
 
   return INTERPRET_OK;
 }
 
-static InterpretResult runSingle(ObjFiber** fiberPtr, CallFrame** framePtr, Byte instruction) {
-
-#define READ_SHORT() \
-  ((*framePtr)->ip += 2, \
-  (uint16_t)(((*framePtr)->ip[-2] << BYTE_WIDTH) | (*framePtr)->ip[-1]))
+#define RUN_NAME runPlain
+#define RUN_TRACE 0
+#include "vm.inc"
+#undef RUN_NAME
+#undef RUN_TRACE
 
-#define READ_CONSTANT() \
-  ((*framePtr)->closure->function->chunk.constants.values[readByte(framePtr)])
-
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-
-#define BINARY_OP(valueType, op)                \
-  do { \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers."); \
-      return INTERPRET_RUNTIME_ERROR; \
-    } \
-    double b = AS_NUMBER(pop()); \
-    double a = AS_NUMBER(pop()); \
-    push(valueType(a op b)); \
-  } while (false)
-
-  switch (instruction) {
-    case OP_ADD: {
-      BINARY_OP(NUMBER_VAL, +);
-      break;
-    }
-
-    case OP_CALL: {
-      int argCount = readByte(framePtr);
-      if (!callValue(peek(argCount), argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      (*framePtr) = &vm_.current->frames[vm_.current->frameCount - 1];
-      break;
-    }
-
-    case OP_CALL_POSTFIX: {
-      int argCount = (int)readByte(framePtr);
-      if (!callValuePostfix(peek(0), argCount)) {
-	return INTERPRET_RUNTIME_ERROR;
-      }
-      (*framePtr) = &vm_.current->frames[vm_.current->frameCount - 1];
-      break;
-    }
-
-    case OP_CLASS: {
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
-    }
+#define RUN_NAME runTraced
+#define RUN_TRACE 1
+#include "vm.inc"
+#undef RUN_NAME
+#undef RUN_TRACE
 
-    case OP_CLOSURE: {
-      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure* closure = newClosure(function);
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalueCount; i++) {
-        Byte isLocal = readByte(framePtr);
-        Byte index = readByte(framePtr);
-        if (isLocal) {
-          closure->upvalues[i] = captureUpvalue((*framePtr)->slots + index);
-        }
-	else {
-          closure->upvalues[i] = (*framePtr)->closure->upvalues[index];
-        }
-      }
-      break;
-    }
-
-    case OP_COLLECTION_LIST: {
-      int numValues = readByte(framePtr);
-      InterpretResult result = createCoreList(numValues);
-      if (result != INTERPRET_OK) {
-        return result;
-      }
-      break;
-    }
-
-    case OP_COLLECTION_TABLE: {
-      int numValues = readByte(framePtr);
-      InterpretResult result = createCoreTable(numValues);
-      if (result != INTERPRET_OK) {
-	return result;
-      }
-      break;
-    }
-
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
-    }
-
-    case OP_DIVIDE: {
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    }
-
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
-    }
-
-    case OP_FALSE: {
-      push(BOOL_VAL(false));
-      break;
-    }
-
-    case OP_GLOBAL_DEFINE: {
-      ObjString* name = READ_STRING();
-      tableSet(&vm_.globals, name, peek(0));
-      pop();
-      break;
-    }
-
-    case OP_GLOBAL_GET: {
-      ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm_.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
-      break;
-    }
-
-    case OP_GLOBAL_SET: {
-      ObjString* name = READ_STRING();
-      if (tableSet(&vm_.globals, name, peek(0))) {
-        tableDelete(&vm_.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
-
-    case OP_GREATER: {
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    }
-
-    case OP_INHERIT: {
-      Value superclass = peek(1);
-      if (!IS_CLASS(superclass)) {
-        runtimeError("Superclass must be a class.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      ObjClass* subclass = AS_CLASS(peek(0));
-      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-      pop();
-      break;
-    }
-
-    case OP_INVOKE: {
-      ObjString* method = READ_STRING();
-      int argCount = readByte(framePtr);
-      if (!invoke(method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      (*framePtr) = &vm_.current->frames[vm_.current->frameCount - 1];
-      break;
-    }
-
-    case OP_INVOKE_SUPER: {
-      ObjString* method = READ_STRING();
-      int argCount = readByte(framePtr);
-      ObjClass* superclass = AS_CLASS(pop());
-      if (!invokeFromClass(superclass, method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      (*framePtr) = &vm_.current->frames[vm_.current->frameCount - 1];
-      break;
-    }
-
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      (*framePtr)->ip += offset;
-      break;
-    }
-
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0))) {
-        (*framePtr)->ip += offset;
-      }
-      break;
-    }
-
-    case OP_LESS: {
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    }
-
-    case OP_LOCAL_GET: {
-      Byte slot = readByte(framePtr);
-      push((*framePtr)->slots[slot]);
-      break;
-    }
-
-    case OP_LOCAL_SET: {
-      Byte slot = readByte(framePtr);
-      (*framePtr)->slots[slot] = peek(0);
-      break;
-    }
-
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-      (*framePtr)->ip -= offset;
-      break;
-    }
-
-    case OP_METHOD: {
-      defineMethod(READ_STRING());
-      break;
-    }
-
-    case OP_MULTIPLY: {
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    }
-
-    case OP_NEGATE: {
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    }
-
-    case OP_NIL: {
-      push(NIL_VAL);
-      break;
-    }
-
-    case OP_NOT: {
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    }
-
-    case OP_POP: {
-      pop();
-      break;
-    }
-
-    case OP_PROPERTY_GET: {
-      if (!IS_INSTANCE(peek(0))) {
-        runtimeError("Only instances have properties.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      ObjInstance* instance = AS_INSTANCE(peek(0));
-      ObjString* name = READ_STRING();
-
-      Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        pop(); // Instance.
-        push(value);
-        break;
-      }
-
-      if (!bindMethod(instance->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
-
-    case OP_PROPERTY_SET: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtimeError("Only instances have fields.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      ObjInstance* instance = AS_INSTANCE(peek(1));
-      tableSet(&instance->fields, READ_STRING(), peek(0));
-      Value value = pop();
-      pop();
-      push(value);
-      break;
-    }
-
-    case OP_RETURN: {
-      Value result = pop();
-      closeUpvalues((*framePtr)->slots);
-      vm_.current->frameCount--;
-      if (vm_.current->frameCount == 0) {
-        pop();
-        return INTERPRET_OK;
-      }
-      vm_.current->stackTop = (*framePtr)->slots;
-      push(result);
-      (*framePtr) = &vm_.current->frames[vm_.current->frameCount - 1];
-      break;
-    }
-
-    case OP_SUBTRACT: {
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    }
-
-    case OP_SUPER_GET: {
-      ObjString* name = READ_STRING();
-      ObjClass* superclass = AS_CLASS(pop());
-      if (!bindMethod(superclass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
-
-    case OP_TRUE: {
-      push(BOOL_VAL(true));
-      break;
-    }
-
-    case OP_UPVALUE_GET: {
-      Byte slot = readByte(framePtr);
-      push(*(*framePtr)->closure->upvalues[slot]->location);
-      break;
-    }
-
-    case OP_UPVALUE_SET: {
-      Byte slot = readByte(framePtr);
-      *(*framePtr)->closure->upvalues[slot]->location = peek(0);
-      break;
-    }
-
-    case OP_UPVALUE_CLOSE: {
-      closeUpvalues(vm_.current->stackTop - 1);
-      pop();
-      break;
-    }
+static InterpretResult run() {
+  return config_.dbg_exec ? runTraced() : runPlain();
+}
 
-    default : {
-      runtimeError("Unknown instruction.");
-      return INTERPRET_RUNTIME_ERROR;
-    }
+// Call the value below the 'argCount' arguments on top of the stack from
+// a native, and run it until it returns, leaving its result in their
+// place. The native's arguments must be read from the stack again
+// afterwards, since the stack may have grown and moved, and the heap
+// may have been compacted. Returns false if the call failed, in which
+// case the error has been reported, the stacks have been reset, and the
+// native should return at once.
+bool callFromNative(int argCount) {
+  ObjFiber* fiber = vm_.current;
+  int frameCount = fiber->frameCount;
+  if (!callValue(peek(argCount), argCount)) {
+    vm_.nativeError = callbackFailed_;
+    return false;
+  }
+  if (fiber->frameCount == frameCount) {
+    return true; // A native, or a class without an initializer.
   }
 
-  return INTERPRET_CONTINUE;
-
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
-}
-
-static InterpretResult run() {
-  CallFrame* frame = &vm_.current->frames[vm_.current->frameCount - 1];
-  InterpretResult result = INTERPRET_CONTINUE;
-  while (result == INTERPRET_CONTINUE) {
-    if (config_.dbg_exec) {
-      traceExecution(vm_.current, frame);
-    }
-    Byte instruction = readByte(&frame);
-    result = runSingle(&vm_.current, &frame, instruction);
+  int enclosing = vm_.callbackBase;
+  vm_.callbackBase = frameCount;
+  InterpretResult result = run();
+  vm_.callbackBase = enclosing;
+  if (result != INTERPRET_OK) {
+    vm_.nativeError = callbackFailed_;
+    return false;
   }
-  return result;
+  return true;
 }
 
 InterpretResult interpret(const char* source) {
@@ -655,6 +831,7 @@ InterpretResult interpret(const char* source) {
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
+  vm_.root->state = FIBER_RUNNING;
 
   return run();
 }
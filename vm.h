@@ -2,24 +2,89 @@
 #define vm_h
 
 #include "object.h"
+#include "slab.h"
 #include "table.h"
 #include "value.h"
 
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING
+} GcState;
+
+// Bucket i counts pauses of [2^(i-1), 2^i) microseconds, bucket 0 those
+// under a microsecond.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+  int counts[GC_PAUSE_BUCKETS];
+  int count;
+  double max;
+} PauseHistogram;
+
+// Totals since the VM started, for gcStats().
+typedef struct {
+  int minorCollections;
+  int pauseCount;
+  double totalPauseMicros;
+  double maxPauseMicros;
+  size_t bytesAllocated;               // Never decreases.
+  size_t bytesFreed;
+  size_t liveBytes[OBJ_TYPE_COUNT];    // After the latest major collection.
+  double startMicros;
+} GcStats;
+
 typedef struct {
   ObjFiber* current;
+  ObjFiber* root;
+  ObjFiber* readyHead;
+  ObjFiber* readyTail;
   Table globals;
   Table strings;
+  ObjShape* emptyShape;
+
+  // core.loon methods that OP_INDEX_GET and OP_INDEX_SET bypass.
+  ObjClosure* listGetAt;
+  ObjClosure* listSetAt;
+  ObjClosure* tableGetAt;
+  ObjClosure* tableSetAt;
+
+  // core.loon iter() methods that OP_ITER_INIT bypasses.
+  ObjClosure* listIter;
+  ObjClosure* tableIter;
+  ObjClosure* rangeIter;
+  ObjClosure* iteratorIter;
 
+  Slabs slabs;
   size_t bytesAllocated;
   size_t nextGC;
-  Obj* objects;
+  size_t nextYoungGC;
+  bool collectingYoung;
+  GcState gcState;
+  int gcCycles;
+  bool compactPending; // Compact at the next safe point.
+  int compactions;
+  int sweepClass;      // Size class of the next page to sweep.
+  SlabPage* sweepPage;
+  PauseHistogram pauses;
+  GcStats gcStats;
+  double markMicros;  // Time spent marking in the latest major collection.
+  double sweepMicros; // And sweeping.
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  size_t cacheHits;
+  size_t cacheMisses;
+
+  const char* nativeError; // Set by a native that failed.
+  int callbackBase;        // Frames below the innermost callback, or 0.
 } VM;
 
 typedef enum {
-  INTERPRET_CONTINUE,
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR
@@ -32,5 +97,11 @@ void freeVM();
 InterpretResult interpret(const char* source);
 void push(Value value);
 Value pop();
+ObjInstance* newCoreInstance(Value className, Obj* data);
+bool resumeFiber(ObjFiber* fiber, Value value);
+void yieldFiber(Value value);
+void spawnFiber(ObjFiber* fiber);
+Value nativeError(const char* message);
+bool callFromNative(int argCount);
 
 #endif